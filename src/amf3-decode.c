@@ -20,324 +20,359 @@
 ** THE SOFTWARE.
 */
 
+#include <limits.h>
 #include <string.h>
 #include "amf3.h"
 
-static void decodeEndianData(const char *buf, char *data, size_t size) {
-	size_t i = 1;
-	if (!*(char *)&i) memcpy(data, buf, size); /* Big-endian */
-	else for (i = 0; i < size; ++i) data[i] = buf[size - i - 1]; /* Little-endian */
+static int freeReader(lua_State *L) {
+	amf3_freeReader(lua_touserdata(L, 1));
+	return 0;
 }
 
-static size_t decodeByte(lua_State *L, const char *buf, size_t pos, size_t size, int *val) {
-	if (pos >= size) luaL_error(L, "insufficient data at position %d", pos + 1);
-	*val = buf[pos] & 0xff;
-	return pos + 1;
+static amf3_Reader *newReader(lua_State *L, const char *buf, size_t size) {
+	void *ud;
+	lua_Alloc allocf = lua_getallocf(L, &ud);
+	amf3_Reader *r = lua_newuserdata(L, sizeof *r);
+	amf3_initReader(r, buf, size, allocf, ud);
+	if (luaL_newmetatable(L, MODNAME ".reader")) {
+		lua_pushcfunction(L, freeReader);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	return r;
 }
 
-static size_t decodeU29(lua_State *L, const char *buf, size_t pos, size_t size, int *val) {
-	int len = 0, x = 0;
-	unsigned char c;
-	buf += pos;
-	do {
-		if (pos + len >= size) luaL_error(L, "insufficient U29 data at position %d", pos + 1);
-		c = buf[len++];
-		if (len == 4) {
-			x <<= 8;
-			x |= c;
-			break;
-		}
-		x <<= 7;
-		x |= c & 0x7f;
-	} while (c & 0x80);
-	*val = x;
-	return pos + len;
+static void checkRead(lua_State *L, amf3_Reader *r, int res) {
+	if (res) luaL_error(L, "%s", r->msg);
 }
 
-static size_t decodeInteger(lua_State *L, const char *buf, size_t pos, size_t size, int sign) {
-	int val;
-	pos = decodeU29(L, buf, pos, size, &val);
-	if (sign && (val & 0x10000000)) val -= 0x20000000;
-	lua_pushinteger(L, val);
-	return pos;
+static void pushInteger(lua_State *L, int64_t val) { /* 'val' may overfill 'lua_Integer' */
+	lua_Number n = val;
+	lua_Integer i = (lua_Integer)n;
+	if (i == n) lua_pushinteger(L, i);
+	else lua_pushnumber(L, n);
 }
 
-static size_t decodeU32(lua_State *L, const char *buf, size_t pos, size_t size, unsigned *val) {
-	if (pos + 4 > size) luaL_error(L, "insufficient U32 data at position %d", pos + 1);
-	decodeEndianData(buf + pos, (char *)val, 4);
-	return pos + 4;
+static void storeRef(lua_State *L, int ridx) {
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, ridx, lua_rawlen(L, ridx) + 1);
 }
 
-static size_t decodeInt32(lua_State *L, const char *buf, size_t pos, size_t size, int sign) {
-	unsigned val;
-	pos = decodeU32(L, buf, pos, size, &val);
-	if (sign) lua_pushinteger(L, (signed)val);
-	else { /* 'val' may overfill 'lua_Integer' */
-		lua_Number n = val;
-		lua_Integer i = (lua_Integer)n;
-		if (i == n) lua_pushinteger(L, i);
-		else lua_pushnumber(L, n);
+static void pushValue(lua_State *L, const amf3_Event *ev, int oidx) {
+	if (ev->ref != -1) {
+		lua_rawgeti(L, oidx, ev->ref + 1);
+		if (lua_type(L, -1) == LUA_TBOOLEAN) luaL_error(L, "reference to a row unsupported"); /* See 'decodeColumns' */
+		return;
+	}
+	switch (ev->type) {
+		case AMF3_UNDEFINED:
+			lua_pushnil(L);
+			break;
+		case AMF3_NULL:
+			lua_pushlightuserdata(L, 0);
+			break;
+		case AMF3_FALSE:
+			lua_pushboolean(L, 0);
+			break;
+		case AMF3_TRUE:
+			lua_pushboolean(L, 1);
+			break;
+		case AMF3_INTEGER:
+			pushInteger(L, ev->ival);
+			break;
+		case AMF3_DOUBLE:
+			lua_pushnumber(L, ev->num);
+			break;
+		case AMF3_STRING:
+			lua_pushlstring(L, ev->data, ev->size);
+			break;
+		case AMF3_DATE:
+			lua_pushnumber(L, ev->num);
+			storeRef(L, oidx);
+			break;
+		default: /* XML, XMLDoc, ByteArray */
+			lua_pushlstring(L, ev->data, ev->size);
+			storeRef(L, oidx);
+			break;
 	}
-	return pos;
-}
-
-static size_t decodeFloat(lua_State *L, const char *buf, size_t pos, size_t size) {
-	float val;
-	if (pos + 4 > size) luaL_error(L, "insufficient IEEE-754 data at position %d", pos + 1);
-	decodeEndianData(buf + pos, (char *)&val, 4);
-	lua_pushnumber(L, val);
-	return pos + 4;
 }
 
-static size_t decodeDouble(lua_State *L, const char *buf, size_t pos, size_t size) {
-	double val;
-	if (pos + 8 > size) luaL_error(L, "insufficient IEEE-754 data at position %d", pos + 1);
-	decodeEndianData(buf + pos, (char *)&val, 8);
-	lua_pushnumber(L, val);
-	return pos + 8;
+static void endTable(lua_State *L, const amf3_Event *ev) {
+	switch (ev->type) {
+		case AMF3_ARRAY:
+			lua_pushinteger(L, ev->len);
+			lua_setfield(L, -2, "__array");
+			break;
+		case AMF3_OBJECT:
+			if (!ev->size) break;
+			lua_pushlstring(L, ev->data, ev->size);
+			lua_setfield(L, -2, "__class");
+			break;
+	}
 }
 
-static size_t decodeRef(lua_State *L, const char *buf, size_t pos, size_t size, int ridx, int *val) {
-	int pfx, def;
-	size_t pos_ = pos;
-	pos = decodeU29(L, buf, pos, size, &pfx);
-	def = pfx & 1;
-	pfx >>= 1;
-	if (def) {
-		*val = pfx;
-		return pos;
+static void setItem(lua_State *L, const amf3_Event *ev) {
+	switch (ev->parent) {
+		case AMF3_ARRAY:
+		case AMF3_OBJECT:
+			if (ev->key) lua_rawset(L, -3);
+			else if (ev->parent == AMF3_OBJECT) lua_setfield(L, -2, "__data"); /* Externalizable */
+			else lua_rawseti(L, -2, ev->index + 1);
+			break;
+		case AMF3_DICTIONARY:
+			if (!(ev->index & 1)) break; /* Keep key until value is decoded */
+			if (!lua_isnil(L, -2)) lua_rawset(L, -3);
+			else lua_pop(L, 2);
+			break;
+		default: /* Vector */
+			lua_rawseti(L, -2, ev->index + 1);
+			break;
 	}
-	lua_rawgeti(L, ridx, pfx + 1);
-	if (lua_isnil(L, -1)) luaL_error(L, "invalid reference %d at position %d", pfx, pos_ + 1);
-	*val = -1;
-	return pos;
 }
 
-static void storeRef(lua_State *L, int ridx) {
-	lua_pushvalue(L, -1);
-	lua_rawseti(L, ridx, lua_rawlen(L, ridx) + 1);
+static void callHandler(lua_State *L, int hidx) {
+	if (lua_isnil(L, hidx)) return;
+	lua_pushvalue(L, hidx);
+	lua_insert(L, -2);
+	lua_call(L, 1, 1); /* Transform value */
 }
 
-static size_t decodeString(lua_State *L, const char *buf, size_t pos, size_t size, int ridx, int blob) {
-	int len;
-	pos = decodeRef(L, buf, pos, size, ridx, &len);
-	if (len == -1) return pos;
-	if (pos + len > size) luaL_error(L, "insufficient data of length %d at position %d", len, pos + 1);
-	lua_pushlstring(L, buf + pos, len);
-	if (blob || len) storeRef(L, ridx); /* Empty string is never sent by reference */
-	return pos + len;
+static int decodeValue(lua_State *L, amf3_Reader *r, int hidx, int oidx, int base, int budget) {
+	/* Decodes values until a value at depth 'base' is complete (returns 1) or 'budget' values have been
+	** decoded (returns 0). A negative 'budget' means no limit. */
+	amf3_Event ev;
+	for (;;) {
+		if (!budget) return 0;
+		if (budget > 0) --budget;
+		checkRead(L, r, amf3_next(r, &ev));
+		switch (ev.event) {
+			case AMF3_EVENT_BEGIN:
+				checkStack(L);
+				if (ev.key) lua_pushlstring(L, ev.key, ev.ksize);
+				lua_newtable(L);
+				storeRef(L, oidx);
+				continue;
+			case AMF3_EVENT_END:
+				endTable(L, &ev);
+				break;
+			default:
+				if (ev.key) lua_pushlstring(L, ev.key, ev.ksize);
+				pushValue(L, &ev, oidx);
+				break;
+		}
+		if (lua_istable(L, -1)) callHandler(L, hidx);
+		if (amf3_depth(r) == base) return 1;
+		setItem(L, &ev);
+	}
 }
 
-static size_t decodeDate(lua_State *L, const char *buf, size_t pos, size_t size, int ridx) {
-	int pfx;
-	pos = decodeRef(L, buf, pos, size, ridx, &pfx);
-	if (pfx == -1) return pos;
-	pos = decodeDouble(L, buf, pos, size);
-	storeRef(L, ridx);
-	return pos;
+static size_t getLimit(lua_State *L, int idx, const char *name, size_t max) {
+	lua_Number n;
+	lua_getfield(L, idx, name);
+	if (lua_isnil(L, -1)) n = 0; /* No limit */
+	else if ((n = lua_tonumber(L, -1)) < 1) luaL_error(L, "invalid limit '%s'", name);
+	lua_pop(L, 1);
+	return n < max ? (size_t)n : max;
 }
 
-static size_t decodeValue(lua_State *L, const char *buf, size_t pos, size_t size, int hidx, int sidx, int oidx, int tidx);
+static void setLimits(lua_State *L, amf3_Reader *r, int idx) {
+	if (lua_isnil(L, idx)) return;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	r->maxdepth = getLimit(L, idx, "depth", INT_MAX);
+	r->maxlen = getLimit(L, idx, "length", INT_MAX);
+	r->maxnodes = getLimit(L, idx, "values", (size_t)-1);
+	r->maxbytes = getLimit(L, idx, "bytes", (size_t)-1);
+}
 
-static size_t decodeArray(lua_State *L, const char *buf, size_t pos, size_t size, int hidx, int sidx, int oidx, int tidx) {
-	int len, i;
-	pos = decodeRef(L, buf, pos, size, oidx, &len);
-	if (len == -1) return pos;
+int amf3__decode(lua_State *L) {
+	size_t size;
+	const char *buf = luaL_checklstring(L, 1, &size);
+	size_t pos = luaL_optinteger(L, 2, 1) - 1;
+	amf3_Reader *r;
+	checkRange(L, pos <= size, 2);
+	lua_settop(L, 4);
 	lua_newtable(L);
-	storeRef(L, oidx);
-	checkStack(L);
-	for (;;) { /* Associative part */
-		pos = decodeString(L, buf, pos, size, sidx, 0);
-		if (!lua_rawlen(L, -1)) {
-			lua_pop(L, 1);
-			break;
-		}
-		pos = decodeValue(L, buf, pos, size, hidx, sidx, oidx, tidx);
-		lua_rawset(L, -3);
-	}
-	for (i = 0; i < len; ++i) { /* Dense part */
-		pos = decodeValue(L, buf, pos, size, hidx, sidx, oidx, tidx);
-		lua_rawseti(L, -2, i + 1);
-	}
-	lua_pushinteger(L, len);
-	lua_setfield(L, -2, "__array");
-	return pos;
+	r = newReader(L, buf, size);
+	r->pos = pos;
+	setLimits(L, r, 4);
+	decodeValue(L, r, 3, 5, 0, -1);
+	lua_pushinteger(L, r->pos + 1);
+	return 2;
 }
 
-static size_t decodeObject(lua_State *L, const char *buf, size_t pos, size_t size, int hidx, int sidx, int oidx, int tidx) {
-	int pfx, def;
-	size_t pos_ = pos;
-	pos = decodeRef(L, buf, pos, size, oidx, &pfx);
-	if (pfx == -1) return pos;
-	def = pfx & 1;
-	pfx >>= 1;
-	if (def) { /* New traits */
-		int i, n = pfx >> 2;
-		lua_newtable(L);
-		storeRef(L, tidx);
-		lua_pushinteger(L, pfx);
-		lua_rawseti(L, -2, 1);
-		pos = decodeString(L, buf, pos, size, sidx, 0); /* Class name */
-		lua_rawseti(L, -2, 2);
-		for (i = 0; i < n; ++i) { /* Static member names */
-			pos = decodeString(L, buf, pos, size, sidx, 0);
-			lua_rawseti(L, -2, i + 3);
-		}
-	} else { /* Existing traits */
-		lua_rawgeti(L, tidx, pfx + 1);
-		if (lua_isnil(L, -1)) luaL_error(L, "invalid class reference %d at position %d", pfx, pos_ + 1);
-		lua_rawgeti(L, -1, 1);
-		pfx = lua_tointeger(L, -1);
+static void setColumn(lua_State *L, const amf3_Event *ev, int cidx, int row) { /* Pops value into column 'ev->key' */
+	lua_pushlstring(L, ev->key, ev->ksize);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, cidx);
+	if (lua_isnil(L, -1)) {
 		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, cidx);
 	}
-	lua_newtable(L);
-	storeRef(L, oidx);
-	checkStack(L);
-	if (pfx & 1) { /* Externalizable */
-		pos = decodeValue(L, buf, pos, size, hidx, sidx, oidx, tidx);
-		lua_setfield(L, -2, "__data");
-	} else {
-		int i, n = pfx >> 2;
-		for (i = 0; i < n; ++i) {
-			lua_rawgeti(L, -2, i + 3);
-			pos = decodeValue(L, buf, pos, size, hidx, sidx, oidx, tidx);
-			lua_rawset(L, -3);
-		}
-		if (pfx & 2) { /* Dynamic */
-			for (;;) {
-				pos = decodeString(L, buf, pos, size, sidx, 0);
-				if (!lua_rawlen(L, -1)) {
-					lua_pop(L, 1);
-					break;
-				}
-				pos = decodeValue(L, buf, pos, size, hidx, sidx, oidx, tidx);
-				lua_rawset(L, -3);
-			}
-		}
-	}
-	lua_rawgeti(L, -2, 2);
-	if (lua_rawlen(L, -1)) lua_setfield(L, -2, "__class");
-	else lua_pop(L, 1);
-	lua_remove(L, -2);
-	return pos;
+	lua_pushvalue(L, -3);
+	lua_rawseti(L, -2, row + 1);
+	lua_pop(L, 3);
 }
 
-static size_t decodeVectorItem(lua_State *L, const char *buf, size_t pos, size_t size, int hidx, int sidx, int oidx, int tidx, int type) {
-	switch (type) {
-		case AMF3_VECTOR_INT:
-			return decodeInt32(L, buf, pos, size, 1);
-		case AMF3_VECTOR_UINT:
-			return decodeInt32(L, buf, pos, size, 0);
-		case AMF3_VECTOR_DOUBLE:
-			return decodeDouble(L, buf, pos, size);
-		default:
-			return decodeValue(L, buf, pos, size, hidx, sidx, oidx, tidx);
+static void copyRow(lua_State *L, int cidx, int from, int to) {
+	for (lua_pushnil(L); lua_next(L, cidx); lua_pop(L, 1)) {
+		lua_rawgeti(L, -1, from + 1);
+		lua_rawseti(L, -2, to + 1);
 	}
 }
 
-static size_t decodeVector(lua_State *L, const char *buf, size_t pos, size_t size, int hidx, int sidx, int oidx, int tidx, int type) {
-	int len, i;
-	pos = decodeRef(L, buf, pos, size, oidx, &len);
-	if (len == -1) return pos;
-	pos = decodeByte(L, buf, pos, size, &i); /* 'fixed-vector' marker */
-	if (type == AMF3_VECTOR_OBJECT) { /* 'object-type-name' marker */
-		pos = decodeString(L, buf, pos, size, sidx, 0);
-		lua_pop(L, 1);
+static void endColumns(lua_State *L, int hidx, int cidx, int len) {
+	for (lua_pushnil(L); lua_next(L, cidx);) {
+		lua_pushinteger(L, len);
+		lua_setfield(L, -2, "__array");
+		callHandler(L, hidx);
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, cidx); /* Replacing existing field is allowed during traversal */
 	}
-	lua_newtable(L);
+}
+
+static void decodeColumns(lua_State *L, amf3_Reader *r, int hidx, int oidx, int cidx) {
+	/* Decodes an array of objects of the same class into a table of columns indexed by member names.
+	** Rows are never materialized, so they are stored as 'false' in the object reference table. */
+	amf3_Event ev;
+	const char *cls = 0;
+	size_t csize = 0;
+	int ridx, row = 0;
+	checkRead(L, r, amf3_next(r, &ev));
+	if (ev.event != AMF3_EVENT_BEGIN || ev.type != AMF3_ARRAY) luaL_error(L, "array expected");
+	lua_pushboolean(L, 0);
 	storeRef(L, oidx);
-	checkStack(L);
-	for (i = 0; i < len; ++i) {
-		pos = decodeVectorItem(L, buf, pos, size, hidx, sidx, oidx, tidx, type);
-		lua_rawseti(L, -2, i + 1);
+	lua_newtable(L); /* Row indices by object reference */
+	ridx = lua_gettop(L);
+	for (;;) {
+		checkRead(L, r, amf3_next(r, &ev));
+		switch (amf3_depth(r)) {
+			case 0: /* End of array */
+				endColumns(L, hidx, cidx, ev.len);
+				lua_pop(L, 2);
+				return;
+			case 1: /* End of row or reference to a row */
+				if (ev.event == AMF3_EVENT_END) continue;
+				if (ev.ref != -1 && !ev.key) {
+					lua_rawgeti(L, ridx, ev.ref + 1);
+					if (lua_isnumber(L, -1)) {
+						copyRow(L, cidx, lua_tointeger(L, -1), ev.index);
+						lua_pop(L, 1);
+						continue;
+					}
+				}
+				luaL_error(L, "array of objects expected");
+				break;
+			case 2:
+				if (ev.event == AMF3_EVENT_BEGIN) { /* Row */
+					if (ev.key || ev.type != AMF3_OBJECT || (ev.traits & AMF3_TRAITS_EXTERNALIZABLE)) luaL_error(L, "array of objects expected");
+					if (!cls) {
+						cls = ev.data ? ev.data : "";
+						csize = ev.size;
+					} else if (ev.size != csize || (csize && memcmp(ev.data, cls, csize))) luaL_error(L, "objects of the same class expected");
+					lua_pushboolean(L, 0);
+					storeRef(L, oidx);
+					lua_pushinteger(L, row = ev.index);
+					lua_rawseti(L, ridx, lua_rawlen(L, oidx));
+					lua_pop(L, 1);
+					continue;
+				}
+				pushValue(L, &ev, oidx);
+				if (lua_istable(L, -1)) callHandler(L, hidx); /* Table sent by reference */
+				break;
+			default: /* Nested table */
+				checkStack(L);
+				lua_newtable(L);
+				storeRef(L, oidx);
+				decodeValue(L, r, hidx, oidx, 2, -1);
+				break;
+		}
+		setColumn(L, &ev, cidx, row);
 	}
-	return pos;
 }
 
-static size_t decodeDictionary(lua_State *L, const char *buf, size_t pos, size_t size, int hidx, int sidx, int oidx, int tidx) {
-	int len, i;
-	pos = decodeRef(L, buf, pos, size, oidx, &len);
-	if (len == -1) return pos;
-	pos = decodeByte(L, buf, pos, size, &i); /* 'weak-keys' marker */
+int amf3__decode_columns(lua_State *L) {
+	size_t size;
+	const char *buf = luaL_checklstring(L, 1, &size);
+	size_t pos = luaL_optinteger(L, 2, 1) - 1;
+	amf3_Reader *r;
+	checkRange(L, pos <= size, 2);
+	lua_settop(L, 4);
 	lua_newtable(L);
-	storeRef(L, oidx);
-	checkStack(L);
-	while (len--) {
-		pos = decodeValue(L, buf, pos, size, hidx, sidx, oidx, tidx);
-		pos = decodeValue(L, buf, pos, size, hidx, sidx, oidx, tidx);
-		if (!lua_isnil(L, -2)) lua_rawset(L, -3);
-		else lua_pop(L, 2);
-	}
-	return pos;
+	r = newReader(L, buf, size);
+	r->pos = pos;
+	setLimits(L, r, 4);
+	lua_newtable(L);
+	decodeColumns(L, r, 3, 5, 7);
+	callHandler(L, 3);
+	lua_pushinteger(L, r->pos + 1);
+	return 2;
 }
 
-static size_t decodeValueData(lua_State *L, const char *buf, size_t pos, size_t size, int hidx, int sidx, int oidx, int tidx) {
-	int type;
-	size_t pos_ = pos;
-	pos = decodeByte(L, buf, pos, size, &type);
-	switch (type) {
-		case AMF3_UNDEFINED:
-			lua_pushnil(L);
-			break;
-		case AMF3_NULL:
-			lua_pushlightuserdata(L, 0);
-			break;
-		case AMF3_FALSE:
-			lua_pushboolean(L, 0);
-			break;
-		case AMF3_TRUE:
-			lua_pushboolean(L, 1);
-			break;
-		case AMF3_INTEGER:
-			return decodeInteger(L, buf, pos, size, 1);
-		case AMF3_DOUBLE:
-			return decodeDouble(L, buf, pos, size);
-		case AMF3_STRING:
-			return decodeString(L, buf, pos, size, sidx, 0);
-		case AMF3_XML:
-		case AMF3_XMLDOC:
-		case AMF3_BYTEARRAY:
-			return decodeString(L, buf, pos, size, oidx, 1);
-		case AMF3_DATE:
-			return decodeDate(L, buf, pos, size, oidx);
-		case AMF3_ARRAY:
-			return decodeArray(L, buf, pos, size, hidx, sidx, oidx, tidx);
-		case AMF3_OBJECT:
-			return decodeObject(L, buf, pos, size, hidx, sidx, oidx, tidx);
-		case AMF3_VECTOR_INT:
-		case AMF3_VECTOR_UINT:
-		case AMF3_VECTOR_DOUBLE:
-		case AMF3_VECTOR_OBJECT:
-			return decodeVector(L, buf, pos, size, hidx, sidx, oidx, tidx, type);
-		case AMF3_DICTIONARY:
-			return decodeDictionary(L, buf, pos, size, hidx, sidx, oidx, tidx);
-		default:
-			luaL_error(L, "invalid value type %d at position %d", type, pos_ + 1);
-			break;
+typedef struct {
+	amf3_Reader *r;
+	int ref; /* Job's stack saved between steps */
+} DecodeJob;
+
+static DecodeJob *checkDecodeJob(lua_State *L) {
+	return luaL_checkudata(L, 1, MODNAME ".decode_job");
+}
+
+static int stepDecodeJob(lua_State *L) {
+	DecodeJob *j = checkDecodeJob(L);
+	int budget = amf3__checkBudget(L, 2);
+	if (j->ref == LUA_NOREF) return luaL_error(L, "job is finished");
+	lua_settop(L, 2);
+	amf3__restoreStack(L, &j->ref); /* Job is finished unless the step completes normally */
+	if (decodeValue(L, j->r, 3, 4, 0, budget)) {
+		lua_pushboolean(L, 1);
+		lua_insert(L, -2);
+		lua_pushinteger(L, j->r->pos + 1);
+		return 3;
 	}
-	return pos;
+	amf3__saveStack(L, &j->ref, 3);
+	lua_pushboolean(L, 0);
+	return 1;
 }
 
-static size_t decodeValue(lua_State *L, const char *buf, size_t pos, size_t size, int hidx, int sidx, int oidx, int tidx) {
-	pos = decodeValueData(L, buf, pos, size, hidx, sidx, oidx, tidx);
-	if (lua_isnil(L, hidx) || !lua_istable(L, -1)) return pos;
-	lua_pushvalue(L, hidx);
-	lua_insert(L, -2);
-	lua_call(L, 1, 1); /* Transform value */
-	return pos;
+static int freeDecodeJob(lua_State *L) {
+	luaL_unref(L, LUA_REGISTRYINDEX, checkDecodeJob(L)->ref);
+	return 0;
 }
 
-int amf3__decode(lua_State *L) {
+int amf3__decode_job(lua_State *L) {
 	size_t size;
 	const char *buf = luaL_checklstring(L, 1, &size);
 	size_t pos = luaL_optinteger(L, 2, 1) - 1;
+	DecodeJob *j;
 	checkRange(L, pos <= size, 2);
-	lua_settop(L, 3);
-	lua_newtable(L);
-	lua_newtable(L);
+	lua_settop(L, 4);
+	j = lua_newuserdata(L, sizeof *j);
+	j->ref = LUA_NOREF;
+	if (luaL_newmetatable(L, MODNAME ".decode_job")) {
+		lua_pushcfunction(L, stepDecodeJob);
+		lua_setfield(L, -2, "step");
+		lua_pushcfunction(L, freeDecodeJob);
+		lua_setfield(L, -2, "__gc");
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	j->r = newReader(L, buf, size);
+	j->r->pos = pos;
+	setLimits(L, j->r, 4);
+	lua_replace(L, 4);
+	lua_insert(L, 1);
+	lua_remove(L, 3); /* Job, data, handler, reader */
 	lua_newtable(L);
-	lua_pushinteger(L, decodeValue(L, buf, pos, size, 3, 4, 5, 6) + 1);
-	return 2;
+	lua_insert(L, 4);
+	lua_pushvalue(L, 2); /* Keep data alive */
+	amf3__saveStack(L, &j->ref, 3); /* Same layout as in 'stepDecodeJob' */
+	lua_settop(L, 1);
+	return 1;
 }
 
 int amf3__unpack(lua_State *L) {
@@ -345,48 +380,61 @@ int amf3__unpack(lua_State *L) {
 	size_t size;
 	const char *buf = luaL_checklstring(L, 2, &size);
 	size_t pos = luaL_optinteger(L, 3, 1) - 1;
+	amf3_Reader r;
 	int nres, opt;
 	checkRange(L, pos <= size, 3);
+	amf3_initReader(&r, buf, size, 0, 0); /* Primitives never allocate memory */
+	r.pos = pos;
 	for (nres = 0; (opt = *fmt++); ++nres) {
 		switch (opt) {
 			case 'b': {
 				int val;
-				pos = decodeByte(L, buf, pos, size, &val);
+				checkRead(L, &r, amf3_readByte(&r, &val));
 				lua_pushinteger(L, val);
 				break;
 			}
 			case 'i':
-				pos = decodeInteger(L, buf, pos, size, 1);
+			case 'u': {
+				int val;
+				checkRead(L, &r, amf3_readU29(&r, &val));
+				if (opt == 'i' && (val & 0x10000000)) val -= 0x20000000;
+				lua_pushinteger(L, val);
 				break;
+			}
 			case 'I':
-				pos = decodeInt32(L, buf, pos, size, 1);
-				break;
-			case 'u':
-				pos = decodeInteger(L, buf, pos, size, 0);
+			case 'U': {
+				uint32_t val;
+				checkRead(L, &r, amf3_readU32(&r, &val));
+				if (opt == 'I') lua_pushinteger(L, (int32_t)val);
+				else pushInteger(L, val);
 				break;
-			case 'U':
-				pos = decodeInt32(L, buf, pos, size, 0);
-				break;
-			case 'f':
-				pos = decodeFloat(L, buf, pos, size);
+			}
+			case 'f': {
+				float val;
+				checkRead(L, &r, amf3_readFloat(&r, &val));
+				lua_pushnumber(L, val);
 				break;
-			case 'd':
-				pos = decodeDouble(L, buf, pos, size);
+			}
+			case 'd': {
+				double val;
+				checkRead(L, &r, amf3_readDouble(&r, &val));
+				lua_pushnumber(L, val);
 				break;
+			}
 			case 's': {
 				int len;
-				pos = decodeU29(L, buf, pos, size, &len);
-				if (pos + len > size) luaL_error(L, "insufficient data of length %d at position %d", len, pos + 1);
-				lua_pushlstring(L, buf + pos, len);
-				pos += len;
+				const char *str;
+				checkRead(L, &r, amf3_readU29(&r, &len));
+				checkRead(L, &r, amf3_readData(&r, len, &str));
+				lua_pushlstring(L, str, len);
 				break;
 			}
 			case 'S': {
-				unsigned len;
-				pos = decodeU32(L, buf, pos, size, &len);
-				if (pos + len > size) luaL_error(L, "insufficient data of length %d at position %d", len, pos + 1);
-				lua_pushlstring(L, buf + pos, len);
-				pos += len;
+				uint32_t len;
+				const char *str;
+				checkRead(L, &r, amf3_readU32(&r, &len));
+				checkRead(L, &r, amf3_readData(&r, len, &str));
+				lua_pushlstring(L, str, len);
 				break;
 			}
 			default:
@@ -394,6 +442,6 @@ int amf3__unpack(lua_State *L) {
 		}
 		luaL_checkstack(L, 1, "too many packed values");
 	}
-	lua_pushinteger(L, pos + 1);
+	lua_pushinteger(L, r.pos + 1);
 	return nres + 1;
 }
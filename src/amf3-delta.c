@@ -0,0 +1,376 @@
+/*
+** Copyright (C) 2012-2020 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include "amf3.h"
+
+#define MAXSTACK 1000 /* Arbitrary stack size limit to check for recursion */
+
+typedef struct {
+	int ref; /* Reference to the last snapshot */
+} Delta;
+
+static int pushBytes(lua_State *L, int idx) { /* Pushes blob data and returns 1 if value is a '__bytes' table */
+	if (!lua_istable(L, idx)) return 0;
+	lua_pushliteral(L, "__bytes");
+	lua_rawget(L, idx);
+	if (lua_type(L, -1) == LUA_TSTRING) return 1;
+	lua_pop(L, 1);
+	return 0;
+}
+
+static int isPlainTable(lua_State *L, int idx) {
+	if (!lua_istable(L, idx)) return 0;
+	if (lua_getmetatable(L, idx)) {
+		lua_pop(L, 1);
+		return 0; /* Tables with metatables are compared by identity */
+	}
+	if (!pushBytes(L, idx)) return 1;
+	lua_pop(L, 1);
+	return 0; /* Blobs are compared by contents */
+}
+
+static int sameValue(lua_State *L, int idx1, int idx2) {
+	int res;
+	if (!pushBytes(L, idx1)) return lua_rawequal(L, idx1, idx2);
+	if (!pushBytes(L, idx2)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	res = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return res;
+}
+
+static int isPrimitive(lua_State *L, int idx) {
+	int type = lua_type(L, idx);
+	return type == LUA_TBOOLEAN || type == LUA_TNUMBER || type == LUA_TSTRING;
+}
+
+static void transformValue(lua_State *L, int idx, const char *ev) { /* Pushes value as it is seen by 'amf3.encode' */
+	if (!luaL_callmeta(L, idx, ev)) lua_pushvalue(L, idx);
+}
+
+static lua_Integer arrayLength(lua_State *L, int idx) { /* Same rules as in 'amf3.encode' */
+	lua_Integer len = -1; /* Not an array */
+	lua_getfield(L, idx, "__array");
+	if (lua_toboolean(L, -1)) {
+		lua_Number n = lua_tonumber(L, -1);
+		len = lua_type(L, -1) == LUA_TNUMBER && n == (lua_Integer)n ? (lua_Integer)n : (lua_Integer)lua_rawlen(L, idx);
+		if (len < 0) len = 0;
+	}
+	lua_pop(L, 1);
+	return len;
+}
+
+static void checkDepth(lua_State *L) {
+	if (lua_gettop(L) >= MAXSTACK) luaL_error(L, "recursion detected");
+	checkStack(L);
+}
+
+static void copyValue(lua_State *L, int idx, const char *ev);
+
+static void copyField(lua_State *L, int top, const char *ev) { /* Copies value 'top + 3' to key 'top + 2' of table 'top + 1' */
+	lua_pushvalue(L, top + 2);
+	transformValue(L, top + 3, ev);
+	copyValue(L, top + 5, ev);
+	lua_remove(L, top + 5);
+	lua_rawset(L, top + 1);
+}
+
+static void copyTable(lua_State *L, int idx, const char *ev) { /* Pushes a plain copy of a table as it is encoded */
+	lua_Integer i, len = arrayLength(L, idx);
+	int top = lua_gettop(L);
+	checkDepth(L);
+	lua_newtable(L);
+	if (len == -1) {
+		for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) copyField(L, top, ev);
+		return;
+	}
+	for (i = 1; i <= len; ++i) { /* Other keys of an array are not encoded */
+		lua_pushinteger(L, i);
+		lua_rawgeti(L, idx, i);
+		copyField(L, top, ev);
+		lua_pop(L, 2);
+	}
+	lua_pushinteger(L, len); /* Store actual length */
+	lua_setfield(L, top + 1, "__array");
+}
+
+static void copyValue(lua_State *L, int idx, const char *ev) { /* Pushes a copy of a transformed value */
+	if (pushBytes(L, idx)) { /* Blob may be changed in place */
+		lua_createtable(L, 0, 1);
+		lua_insert(L, -2);
+		lua_setfield(L, -2, "__bytes");
+	} else if (isPlainTable(L, idx)) copyTable(L, idx, ev);
+	else lua_pushvalue(L, idx);
+}
+
+static void addEntry(lua_State *L, int pidx, const char *name, int kidx, int vidx) { /* Appends to a list of keys/values */
+	int n;
+	if (lua_isnil(L, pidx)) {
+		lua_newtable(L);
+		lua_replace(L, pidx);
+	}
+	lua_getfield(L, pidx, name);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushboolean(L, 1);
+		lua_setfield(L, -2, "__array");
+		lua_pushvalue(L, -1);
+		lua_setfield(L, pidx, name);
+	}
+	n = lua_rawlen(L, -1);
+	lua_pushvalue(L, kidx);
+	lua_rawseti(L, -2, n + 1);
+	if (vidx) {
+		lua_pushvalue(L, vidx);
+		lua_rawseti(L, -2, n + 2);
+	}
+	lua_pop(L, 1);
+}
+
+static int isIndex(lua_State *L, int idx, lua_Integer len) { /* Checks if key is an array index in 1..len */
+	lua_Number n;
+	if (lua_type(L, idx) != LUA_TNUMBER) return 0;
+	n = lua_tonumber(L, idx);
+	return n >= 1 && n <= len && n == (lua_Integer)n;
+}
+
+static int diffTable(lua_State *L, int nidx, int oidx, const char *ev);
+
+static int diffField(lua_State *L, int oidx, int top, const char *ev) {
+	/* Compares value 'top + 4' at key 'top + 3' with the snapshot and adds changes to patch 'top + 1';
+	** returns -1 if the difference cannot be expressed by a patch. */
+	int res;
+	if (!isPrimitive(L, top + 3)) return -1; /* Receiver's copy of the key is a different value */
+	transformValue(L, top + 4, ev);
+	lua_pushvalue(L, top + 3);
+	lua_rawget(L, oidx);
+	if (lua_isnil(L, top + 5)) { /* Decoded as a missing key */
+		if (!lua_isnil(L, top + 6)) {
+			addEntry(L, top + 1, "d", top + 3, 0);
+			lua_pushvalue(L, top + 3);
+			lua_pushnil(L);
+			lua_rawset(L, oidx);
+		}
+	} else if (isPlainTable(L, top + 5) && isPlainTable(L, top + 6)) {
+		if ((res = diffTable(L, top + 5, top + 6, ev)) == -1) return -1;
+		if (res) addEntry(L, top + 1, "p", top + 3, top + 7);
+	} else if (!sameValue(L, top + 5, top + 6)) {
+		copyValue(L, top + 5, ev);
+		addEntry(L, top + 1, "s", top + 3, top + 7);
+		lua_pushvalue(L, top + 3);
+		lua_pushvalue(L, top + 7);
+		lua_rawset(L, oidx);
+	}
+	lua_settop(L, top + 4);
+	return 0;
+}
+
+static int diffTable(lua_State *L, int nidx, int oidx, const char *ev) {
+	/* Updates snapshot 'oidx' and pushes patch if any (returns 1), returns 0 if there are no changes,
+	** or returns -1 if the difference cannot be expressed by a patch. */
+	lua_Integer i, len = arrayLength(L, nidx);
+	int res, top = lua_gettop(L);
+	checkDepth(L);
+	lua_pushnil(L); /* Patch */
+	lua_pushliteral(L, "__array");
+	lua_getfield(L, oidx, "__array");
+	if (len != -1 && (!lua_isnumber(L, top + 3) || lua_tointeger(L, top + 3) != len)) {
+		lua_pushinteger(L, len);
+		lua_replace(L, top + 3);
+		addEntry(L, top + 1, "s", top + 2, top + 3);
+		lua_pushvalue(L, top + 3);
+		lua_setfield(L, oidx, "__array");
+	}
+	lua_pop(L, 1);
+	if (len == -1) {
+		for (lua_pushnil(L); lua_next(L, nidx); lua_pop(L, 1)) { /* New and changed keys */
+			if (diffField(L, oidx, top, ev) == -1) goto full;
+		}
+	} else for (i = 1; i <= len; ++i) { /* Other keys of an array are not encoded */
+		lua_pushinteger(L, i);
+		lua_rawgeti(L, nidx, i);
+		if (diffField(L, oidx, top, ev) == -1) goto full;
+		lua_pop(L, 2);
+	}
+	for (lua_pushnil(L); lua_next(L, oidx); lua_pop(L, 1)) { /* Removed keys */
+		if (!isPrimitive(L, top + 3)) goto full;
+		if (len == -1) {
+			lua_pushvalue(L, top + 3);
+			lua_rawget(L, nidx);
+			res = !lua_isnil(L, -1);
+			lua_pop(L, 1);
+		} else res = lua_rawequal(L, top + 3, top + 2) || isIndex(L, top + 3, len); /* Items are handled above */
+		if (res) continue;
+		addEntry(L, top + 1, "d", top + 3, 0);
+		lua_pushvalue(L, top + 3);
+		lua_pushnil(L);
+		lua_rawset(L, oidx); /* Clearing fields during traversal is allowed */
+	}
+	lua_settop(L, top + 1);
+	if (!lua_isnil(L, -1)) return 1;
+	lua_pop(L, 1);
+	return 0;
+full:
+	lua_settop(L, top);
+	return -1;
+}
+
+static Delta *checkDelta(lua_State *L) {
+	return luaL_checkudata(L, 1, MODNAME ".delta");
+}
+
+static void setSnapshot(lua_State *L, Delta *d) {
+	luaL_unref(L, LUA_REGISTRYINDEX, d->ref);
+	d->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static int makePatch(lua_State *L) {
+	Delta *d = checkDelta(L);
+	const char *ev = luaL_optstring(L, 3, "__toAMF3");
+	int res = -1;
+	lua_pushcfunction(L, amf3__encode);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, d->ref);
+	transformValue(L, 2, ev);
+	if (isPlainTable(L, 6) && isPlainTable(L, 5)) res = diffTable(L, 6, 5, ev);
+	if (res == -1) { /* Full update */
+		copyValue(L, 6, ev);
+		if (isPlainTable(L, 7)) lua_pushvalue(L, 7);
+		else lua_pushnil(L);
+		setSnapshot(L, d);
+		lua_createtable(L, 0, 1);
+		lua_insert(L, 7);
+		lua_setfield(L, 7, "r");
+	} else if (!res) lua_newtable(L); /* No changes */
+	lua_replace(L, 5);
+	lua_settop(L, 5);
+	lua_pushvalue(L, 3);
+	lua_call(L, 2, 1);
+	return 1;
+}
+
+static int encodeDelta(lua_State *L) {
+	Delta *d = checkDelta(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 3);
+	lua_pushcfunction(L, makePatch);
+	lua_insert(L, 1);
+	if (lua_pcall(L, 3, 1, 0)) { /* Snapshot is out of sync with the receiver */
+		lua_pushnil(L);
+		setSnapshot(L, d);
+		return lua_error(L);
+	}
+	return 1;
+}
+
+static int resetDelta(lua_State *L) {
+	Delta *d = checkDelta(L);
+	lua_pushnil(L);
+	setSnapshot(L, d);
+	return 0;
+}
+
+static int freeDelta(lua_State *L) {
+	luaL_unref(L, LUA_REGISTRYINDEX, checkDelta(L)->ref);
+	return 0;
+}
+
+static const luaL_Reg methods[] = {
+	{"encode", encodeDelta},
+	{"reset", resetDelta},
+	{"__gc", freeDelta},
+	{0, 0}
+};
+
+int amf3__delta(lua_State *L) {
+	Delta *d = lua_newuserdata(L, sizeof *d);
+	d->ref = LUA_NOREF;
+	if (luaL_newmetatable(L, MODNAME ".delta")) {
+		const luaL_Reg *r;
+		for (r = methods; r->name; ++r) {
+			lua_pushcfunction(L, r->func);
+			lua_setfield(L, -2, r->name);
+		}
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int getList(lua_State *L, int pidx, const char *name) { /* Pushes list and returns its length */
+	lua_Integer len;
+	lua_getfield(L, pidx, name);
+	if (lua_isnil(L, -1)) return 0;
+	if (lua_istable(L, -1)) lua_getfield(L, -1, "__array");
+	else lua_pushnil(L);
+	if (!lua_isnumber(L, -1)) luaL_error(L, "invalid delta"); /* Not an array */
+	len = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return len;
+}
+
+static void applyPatch(lua_State *L, int tidx, int pidx) {
+	int i, n, top = lua_gettop(L);
+	checkDepth(L);
+	n = getList(L, pidx, "s");
+	for (i = 1; i < n; i += 2) { /* Set values */
+		lua_rawgeti(L, top + 1, i);
+		lua_rawgeti(L, top + 1, i + 1);
+		lua_rawset(L, tidx);
+	}
+	n = getList(L, pidx, "d");
+	for (i = 1; i <= n; ++i) { /* Removed keys */
+		lua_rawgeti(L, top + 2, i);
+		lua_pushnil(L);
+		lua_rawset(L, tidx);
+	}
+	n = getList(L, pidx, "p");
+	for (i = 1; i < n; i += 2) { /* Nested patches */
+		lua_rawgeti(L, top + 3, i);
+		lua_rawget(L, tidx);
+		lua_rawgeti(L, top + 3, i + 1);
+		if (!lua_istable(L, top + 4) || !lua_istable(L, top + 5)) luaL_error(L, "delta does not match value");
+		applyPatch(L, top + 4, top + 5);
+		lua_pop(L, 2);
+	}
+	lua_settop(L, top);
+}
+
+int amf3__apply_delta(lua_State *L) {
+	lua_settop(L, 3);
+	lua_pushcfunction(L, amf3__decode);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	lua_call(L, 2, 2);
+	if (!lua_istable(L, 4)) return luaL_argerror(L, 2, "invalid delta");
+	lua_getfield(L, 4, "r");
+	if (lua_isnil(L, -1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		applyPatch(L, 1, 4);
+	} else lua_replace(L, 1); /* Full update */
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 5);
+	return 2;
+}
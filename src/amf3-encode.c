@@ -20,209 +20,226 @@
 ** THE SOFTWARE.
 */
 
+#include <limits.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "amf3.h"
 
-#define MAXSTACK 1000 /* Arbitrary stack size limit to check for recursion */
-
-typedef struct {
-	char *buf;
-	size_t pos, size;
-} Box;
+#ifdef _WIN32
+#include <windows.h>
+#endif
 
-static char *resizeBox(lua_State *L, Box *box, size_t size) {
-	void *ud;
-	lua_Alloc allocf = lua_getallocf(L, &ud);
-	char *buf = allocf(ud, box->buf, box->size, size);
-	if (!size) return 0;
-	if (!buf) luaL_error(L, "cannot allocate buffer");
-	box->buf = buf;
-	box->size = size;
-	return buf;
-}
+#define MAXSTACK 1000 /* Arbitrary stack size limit to check for recursion */
+#define MAXDEPTH (MAXSTACK / 2) /* Each open table takes at least two stack slots */
+#define SCRATCH 256 /* Buffer size for encoding without keeping data */
+#define MAXKEY 128 /* Longest key kept in a key cache */
 
-static int freeBox(lua_State *L) {
-	resizeBox(L, lua_touserdata(L, 1), 0);
+static int freeWriter(lua_State *L) {
+	amf3_freeWriter(lua_touserdata(L, 1));
 	return 0;
 }
 
-static Box *newBox(lua_State *L) {
-	Box *box = lua_newuserdata(L, sizeof *box);
-	box->buf = 0;
-	box->pos = 0;
-	box->size = 0;
-	if (luaL_newmetatable(L, MODNAME)) {
-		lua_pushcfunction(L, freeBox);
+static amf3_Writer *newWriter(lua_State *L) {
+	void *ud;
+	lua_Alloc allocf = lua_getallocf(L, &ud);
+	amf3_Writer *w = lua_newuserdata(L, sizeof *w);
+	amf3_initWriter(w, allocf, ud);
+	if (luaL_newmetatable(L, MODNAME ".writer")) {
+		lua_pushcfunction(L, freeWriter);
 		lua_setfield(L, -2, "__gc");
 	}
 	lua_setmetatable(L, -2);
-	resizeBox(L, box, 100);
-	return box;
+	return w;
 }
 
-static char *appendData(lua_State *L, Box *box, size_t size) {
-	char *buf = box->buf;
-	size_t pos = box->pos;
-	size_t old = box->size;
-	size_t new = pos + size;
-	if (new > old) { /* Expand buffer */
-		old <<= 1; /* At least twice the old size */
-		buf = resizeBox(L, box, new > old ? new : old);
-	}
-	box->pos = new;
-	return buf + pos;
+static void checkWrite(lua_State *L, int res) {
+	if (res) luaL_error(L, "cannot allocate buffer");
 }
 
-static void encodeData(lua_State *L, Box *box, const char *data, size_t size) {
-	memcpy(appendData(L, box, size), data, size);
+static void encodeData(lua_State *L, amf3_Writer *w, const char *data, size_t size) {
+	checkWrite(L, amf3_writeData(w, data, size));
 }
 
-static void encodeEndianData(lua_State *L, Box *box, const char *data, size_t size) {
-	size_t i = 1;
-	char *buf = appendData(L, box, size);
-	if (!*(char *)&i) memcpy(buf, data, size); /* Big-endian */
-	else for (i = 0; i < size; ++i) buf[size - i - 1] = data[i]; /* Little-endian */
+static void encodeByte(lua_State *L, amf3_Writer *w, char val) {
+	checkWrite(L, amf3_writeByte(w, val));
 }
 
-static void encodeByte(lua_State *L, Box *box, char val) {
-	*appendData(L, box, 1) = val;
+static void encodeU29(lua_State *L, amf3_Writer *w, int val) {
+	checkWrite(L, amf3_writeU29(w, val));
 }
 
-static void encodeU29(lua_State *L, Box *box, int val) {
-	char buf[4];
-	int len;
-	val &= 0x1fffffff;
-	if (val <= 0x7f) {
-		buf[0] = val;
-		len = 1;
-	} else if (val <= 0x3fff) {
-		buf[0] = (val >> 7) | 0x80;
-		buf[1] = val & 0x7f;
-		len = 2;
-	} else if (val <= 0x1fffff) {
-		buf[0] = (val >> 14) | 0x80;
-		buf[1] = (val >> 7) | 0x80;
-		buf[2] = val & 0x7f;
-		len = 3;
-	} else {
-		buf[0] = (val >> 22) | 0x80;
-		buf[1] = (val >> 15) | 0x80;
-		buf[2] = (val >> 8) | 0x80;
-		buf[3] = val;
-		len = 4;
-	}
-	encodeData(L, box, buf, len);
+static void encodeU32(lua_State *L, amf3_Writer *w, uint32_t val) {
+	checkWrite(L, amf3_writeU32(w, val));
 }
 
-static void encodeU32(lua_State *L, Box *box, int val) {
-	encodeEndianData(L, box, (char *)&val, 4);
+typedef struct {
+	int type; /* AMF3_ARRAY, AMF3_OBJECT or AMF3_DICTIONARY */
+	int base, idx; /* Stack index of the original and the transformed table */
+	int len, index; /* Array length and current item; dictionary key (1) or value (0) is encoded */
+	int keys, nkeys, key; /* Sorted keys in the key buffer and the next one */
+} Frame;
+
+typedef struct {
+	int type; /* Boolean, number or string */
+	int pos; /* String is anchored at this index in the key table */
+	const char *str;
+	size_t len;
+	lua_Number num;
+	lua_Integer ival; /* Integral number or boolean */
+	int isint;
+} Key;
+
+typedef struct KeyCache KeyCache;
+
+typedef struct {
+	amf3_Writer *w;
+	const char *ev; /* Transformation metamethod */
+	int sidx, oidx; /* String/object reference tables (0 if references are disabled) */
+	int nstrs, nobjs; /* Number of referenceable strings/objects encoded so far */
+	int fidx; /* Frozen tables (0 if there are none) */
+	int kidx; /* Key table holding the key buffer and anchoring string keys (0 if keys are not sorted) */
+	int cidx; /* Key cache (0 if there is none) */
+	KeyCache *cache;
+	Key *keys;
+	int nkeys, ckeys;
+	int depth;
+	Frame frames[MAXDEPTH];
+} Encoder;
+
+static void skipRefs(lua_State *L, int *nrefs, int n) {
+	if (n > AMF3_INT_MAX + 1 - *nrefs) luaL_error(L, "reference table overflow");
+	*nrefs += n;
 }
 
-static void encodeFloat(lua_State *L, Box *box, float val) {
-	encodeEndianData(L, box, (char *)&val, 4);
+static int findRef(lua_State *L, int idx, int ridx, int *nrefs) { /* Returns reference to a value seen earlier, or registers the value and returns -1 */
+	if (ridx) {
+		lua_pushvalue(L, idx);
+		lua_rawget(L, ridx);
+		if (!lua_isnil(L, -1)) {
+			int ref = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			return ref;
+		}
+		lua_pop(L, 1);
+		if (*nrefs > AMF3_INT_MAX) luaL_error(L, "reference table overflow");
+		lua_pushvalue(L, idx);
+		lua_pushinteger(L, *nrefs);
+		lua_rawset(L, ridx);
+	}
+	++*nrefs;
+	return -1;
 }
 
-static void encodeDouble(lua_State *L, Box *box, double val) {
-	encodeEndianData(L, box, (char *)&val, 8);
+static void encodeStringRef(lua_State *L, Encoder *e, int ref, int key) {
+	checkWrite(L, key ? amf3_writeU29(e->w, ref << 1) : amf3_writeRef(e->w, AMF3_STRING, ref));
 }
 
-static int encodeRef(lua_State *L, Box *box, int idx, int ridx) {
+struct KeyCache {
+	unsigned serial; /* Current message */
+	int ref; /* Cached keys */
+	int size, count; /* Maximum and current number of cached keys */
+	int sorted;
+	int busy; /* Keys are in use by a message being encoded */
+	char ev[1]; /* Transformation metamethod */
+};
+
+typedef struct {
+	unsigned serial; /* Message in which the key was last encoded */
+	int ref; /* String reference in that message */
+	size_t size;
+	char data[1]; /* Encoded length followed by the key */
+} CachedKey;
+
+static int encodeCached(lua_State *L, Encoder *e, int idx, int key) { /* Returns 0 if the string is not cached and cannot be cached */
+	KeyCache *c = e->cache;
+	CachedKey *k;
+	size_t len, pos;
+	const char *str;
 	int ref;
 	lua_pushvalue(L, idx);
-	lua_rawget(L, ridx);
-	if (!lua_isnil(L, -1)) {
-		encodeU29(L, box, lua_tointeger(L, -1) << 1);
-		lua_pop(L, 1);
+	lua_rawget(L, e->cidx);
+	k = lua_touserdata(L, -1); /* Kept alive by the cache */
+	lua_pop(L, 1);
+	if (k) {
+		if (k->serial == c->serial) encodeStringRef(L, e, k->ref, key);
+		else { /* First occurrence in this message */
+			if (e->nstrs > AMF3_INT_MAX) luaL_error(L, "reference table overflow");
+			k->serial = c->serial;
+			k->ref = e->nstrs++;
+			if (!key) encodeByte(L, e->w, AMF3_STRING);
+			encodeData(L, e->w, k->data, k->size);
+		}
+		return 1;
+	}
+	str = lua_tolstring(L, idx, &len);
+	if (!key || len > MAXKEY || c->count == c->size) return 0;
+	if ((ref = findRef(L, idx, e->sidx, &e->nstrs)) != -1) { /* Also seen as a value; cached in another message */
+		encodeStringRef(L, e, ref, 1);
 		return 1;
 	}
-	lua_rawgeti(L, ridx, 1);
-	ref = lua_tointeger(L, -1);
-	if (ref > AMF3_INT_MAX) luaL_error(L, "reference table overflow");
-	lua_pop(L, 2);
+	pos = e->w->pos;
+	checkWrite(L, amf3_writeKey(e->w, str, len));
 	lua_pushvalue(L, idx);
-	lua_pushinteger(L, ref);
-	lua_rawset(L, ridx);
-	lua_pushinteger(L, ref + 1);
-	lua_rawseti(L, ridx, 1);
-	return 0;
+	k = lua_newuserdata(L, offsetof(CachedKey, data) + e->w->pos - pos);
+	k->serial = c->serial;
+	k->ref = e->nstrs - 1;
+	k->size = e->w->pos - pos;
+	memcpy(k->data, e->w->buf + pos, k->size); /* Writer has no sink */
+	lua_rawset(L, e->cidx);
+	++c->count;
+	return 1;
 }
 
-static void encodeString(lua_State *L, Box *box, int idx, int ridx) {
+static void encodeString(lua_State *L, Encoder *e, int idx, int key) {
 	size_t len;
 	const char *str = lua_tolstring(L, idx, &len);
-	if (len && encodeRef(L, box, idx, ridx)) return; /* Empty string is never sent by reference */
+	int ref;
+	if (len && e->cidx && encodeCached(L, e, idx, key)) return;
+	if (len && (ref = findRef(L, idx, e->sidx, &e->nstrs)) != -1) { /* Empty string is never sent by reference */
+		encodeStringRef(L, e, ref, key);
+		return;
+	}
 	if (len > AMF3_INT_MAX) luaL_error(L, "string too long");
-	encodeU29(L, box, (len << 1) | 1);
-	encodeData(L, box, str, len);
+	checkWrite(L, key ? amf3_writeKey(e->w, str, len) : amf3_writeString(e->w, str, len));
 }
 
-static int error(lua_State *L, int *nerr, const char *fmt, ...) {
-	va_list ap;
-	va_start(ap, fmt);
-#if LUA_VERSION_NUM >= 504
-	luaL_checkstack(L, 1, 0);
-#endif
-	lua_pushvfstring(L, fmt, ap);
-	va_end(ap);
-	lua_insert(L, -(++(*nerr)));
-	return 0;
-}
-
-static int errorTrace(lua_State *L, int *nerr, int idx) {
+static void pushTrace(lua_State *L, int idx) {
 	switch (lua_type(L, idx)) {
 		case LUA_TNUMBER:
 #if LUA_VERSION_NUM >= 503
-			if (lua_isinteger(L, idx)) return error(L, nerr, "[%I] => ", lua_tointeger(L, idx));
+			if (lua_isinteger(L, idx)) {
+				lua_pushfstring(L, "[%I] => ", lua_tointeger(L, idx));
+				break;
+			}
 #endif
-			return error(L, nerr, "[%f] => ", lua_tonumber(L, idx));
+			lua_pushfstring(L, "[%f] => ", lua_tonumber(L, idx));
+			break;
 		case LUA_TSTRING:
-			return error(L, nerr, "[\"%s\"] => ", lua_tostring(L, idx));
+			lua_pushfstring(L, "[\"%s\"] => ", lua_tostring(L, idx));
+			break;
 		default:
-			return error(L, nerr, "[%s: %p] => ", luaL_typename(L, idx), lua_topointer(L, idx));
+			lua_pushfstring(L, "[%s: %p] => ", luaL_typename(L, idx), lua_topointer(L, idx));
+			break;
 	}
 }
 
-static int encodeValue(lua_State *L, Box *box, int idx, const char *ev, int sidx, int oidx, int *tf, int *nerr);
-
-static int encodeArray(lua_State *L, Box *box, int idx, const char *ev, int sidx, int oidx, int *tf, int *nerr, int len, int top) {
+static int error(lua_State *L, Encoder *e, const char *fmt, ...) { /* Pushes error message prefixed with the path to the failed value */
 	int i;
-	if (encodeRef(L, box, idx, oidx)) return 1;
-	encodeU29(L, box, (len << 1) | 1);
-	encodeByte(L, box, 0x01); /* Empty associative part */
-	for (i = 0; i < len; ++i) {
-		lua_rawgeti(L, idx, i + 1);
-		if (!encodeValue(L, box, top + 1, ev, sidx, oidx, tf, nerr)) return error(L, nerr, "[%d] => ", i + 1);
-		lua_pop(L, 1);
-	}
-	return 1;
-}
-
-static int encodeObject(lua_State *L, Box *box, int idx, const char *ev, int sidx, int oidx, int *tf, int *nerr, int top) {
-	if (encodeRef(L, box, idx, oidx)) return 1;
-	if (*tf) encodeByte(L, box, 0x01); /* Traits have been encoded earlier */
-	else {
-		*tf = 1;
-		encodeByte(L, box, 0x0b); /* Traits: no static members, externalizable=0, dynamic=1 */
-		encodeByte(L, box, 0x01); /* Empty class name */
-	}
-	for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
-		encodeString(L, box, top + 1, sidx);
-		if (!encodeValue(L, box, top + 2, ev, sidx, oidx, tf, nerr)) return errorTrace(L, nerr, top + 1);
-	}
-	encodeByte(L, box, 0x01); /* Empty key */
-	return 1;
-}
-
-static int encodeDictionary(lua_State *L, Box *box, int idx, const char *ev, int sidx, int oidx, int *tf, int *nerr, int len, int top) {
-	if (encodeRef(L, box, idx, oidx)) return 1;
-	encodeU29(L, box, (len << 1) | 1);
-	encodeByte(L, box, 0x00); /* weak-keys=0 */
-	for (lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1)) {
-		if (!encodeValue(L, box, top + 1, ev, sidx, oidx, tf, nerr)) return errorTrace(L, nerr, idx);
-		if (!encodeValue(L, box, top + 2, ev, sidx, oidx, tf, nerr)) return errorTrace(L, nerr, top + 1);
+	va_list ap;
+	luaL_checkstack(L, e->depth + 1, 0);
+	for (i = 0; i < e->depth; ++i) {
+		const Frame *f = e->frames + i;
+		if (f->type == AMF3_ARRAY) lua_pushfstring(L, "[%d] => ", f->index);
+		else pushTrace(L, f->type == AMF3_DICTIONARY && f->index ? f->idx : f->idx + 1);
 	}
-	return 1;
+	va_start(ap, fmt);
+	lua_pushvfstring(L, fmt, ap);
+	va_end(ap);
+	lua_concat(L, e->depth + 1);
+	return -1;
 }
 
 static int isInteger(lua_State *L, int idx, lua_Integer *val) {
@@ -247,162 +264,787 @@ static int getTableType(lua_State *L, int idx, int *len) {
 	lua_Integer i;
 	lua_getfield(L, idx, "__array");
 	if (lua_toboolean(L, -1)) {
-		res = LUA_TNUMBER; /* Dense array */
+		res = AMF3_ARRAY; /* Dense array */
 		if (!isInteger(L, -1, &i)) i = lua_rawlen(L, idx);
 		if (i < 0) i = 0;
 	} else {
-		res = LUA_TSTRING; /* Associative array */
-		for (i = 0, lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1), ++i) {
-			if (res == LUA_TNONE) continue; /* Keep counting length */
-			if (lua_type(L, -2) == LUA_TSTRING && lua_rawlen(L, -2)) continue;
-			res = LUA_TNONE; /* Dictionary */
+		lua_pop(L, 1);
+		lua_getfield(L, idx, "__bytes");
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			res = AMF3_BYTEARRAY; /* Blob */
+			i = lua_rawlen(L, -1);
+		} else {
+			res = AMF3_OBJECT; /* Associative array */
+			for (i = 0, lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1), ++i) {
+				if (res == AMF3_DICTIONARY) continue; /* Keep counting length */
+				if (lua_type(L, -2) == LUA_TSTRING && lua_rawlen(L, -2)) continue;
+				res = AMF3_DICTIONARY;
+			}
 		}
 	}
 	lua_pop(L, 1);
-	if (i > AMF3_INT_MAX) luaL_error(L, "table too big");
+	if (i > AMF3_INT_MAX) luaL_error(L, res == AMF3_BYTEARRAY ? "string too long" : "table too big");
 	*len = i;
 	return res;
 }
 
-static int encodeValueData(lua_State *L, Box *box, int idx, const char *ev, int sidx, int oidx, int *tf, int *nerr) {
+static int isSortable(int type) {
+	return type == LUA_TBOOLEAN || type == LUA_TNUMBER || type == LUA_TSTRING;
+}
+
+static int compareKeys(const void *a, const void *b) {
+	const Key *k1 = a, *k2 = b;
+	if (k1->type != k2->type) return k1->type < k2->type ? -1 : 1; /* Booleans, numbers, strings */
+	switch (k1->type) {
+		case LUA_TSTRING: {
+			int res = memcmp(k1->str, k2->str, k1->len < k2->len ? k1->len : k2->len);
+			if (res) return res;
+			return k1->len < k2->len ? -1 : k1->len > k2->len;
+		}
+		case LUA_TNUMBER:
+			if (k1->isint && k2->isint) return k1->ival < k2->ival ? -1 : k1->ival > k2->ival;
+			if (k1->num != k2->num) return k1->num < k2->num ? -1 : 1;
+			return k2->isint - k1->isint;
+		default:
+			return k1->ival - k2->ival;
+	}
+}
+
+static void growKeys(lua_State *L, Encoder *e) {
+	int n = e->ckeys ? e->ckeys << 1 : 64;
+	Key *keys;
+	if (n < 0) luaL_error(L, "table too big");
+	keys = lua_newuserdata(L, n * sizeof *keys);
+	if (e->nkeys) memcpy(keys, e->keys, e->nkeys * sizeof *keys);
+	lua_rawseti(L, e->kidx, 0); /* Old buffer is collected */
+	e->keys = keys;
+	e->ckeys = n;
+}
+
+static void sortKeys(lua_State *L, Encoder *e, Frame *f) {
+	for (lua_pushnil(L); lua_next(L, f->idx); lua_pop(L, 1)) {
+		Key *k;
+		int type = lua_type(L, -2);
+		if (!isSortable(type)) continue; /* Encoded after sorted keys in traversal order */
+		if (e->nkeys == e->ckeys) growKeys(L, e);
+		k = e->keys + e->nkeys++;
+		k->type = type;
+		switch (type) {
+			case LUA_TSTRING: /* Table may drop the key while its value is being transformed */
+				k->pos = e->nkeys;
+				k->str = lua_tolstring(L, -2, &k->len);
+				lua_pushvalue(L, -2);
+				lua_rawseti(L, e->kidx, k->pos);
+				break;
+			case LUA_TNUMBER:
+				k->num = lua_tonumber(L, -2);
+				k->isint = isInteger(L, -2, &k->ival);
+				break;
+			default:
+				k->ival = lua_toboolean(L, -2);
+				break;
+		}
+	}
+	f->nkeys = e->nkeys - f->keys;
+	if (f->nkeys > 1) qsort(e->keys + f->keys, f->nkeys, sizeof *e->keys, compareKeys); /* Buffer is not allocated for tables without keys */
+}
+
+static int nextKey(lua_State *L, Encoder *e, Frame *f) { /* Same as 'lua_next' with sorted keys coming first */
+	const Key *k;
+	if (!e->kidx) return lua_next(L, f->idx);
+	if (f->key > f->nkeys) { /* Remaining keys */
+		while (lua_next(L, f->idx)) {
+			if (!isSortable(lua_type(L, -2))) return 1;
+			lua_pop(L, 1);
+		}
+		return 0;
+	}
+	lua_pop(L, 1);
+	if (f->key == f->nkeys) {
+		++f->key;
+		if (f->type == AMF3_OBJECT) return 0; /* Only string keys */
+		lua_pushnil(L);
+		return nextKey(L, e, f);
+	}
+	k = e->keys + f->keys + f->key++;
+	switch (k->type) {
+		case LUA_TSTRING:
+			lua_rawgeti(L, e->kidx, k->pos);
+			break;
+		case LUA_TNUMBER:
+			if (k->isint) lua_pushinteger(L, k->ival);
+			else lua_pushnumber(L, k->num);
+			break;
+		default:
+			lua_pushboolean(L, k->ival);
+			break;
+	}
+	lua_pushvalue(L, -1);
+	lua_rawget(L, f->idx);
+	return 1;
+}
+
+static int encodeTable(lua_State *L, Encoder *e, int base, int idx) {
+	Frame *f;
+	int len, type, ref;
+	if (idx >= MAXSTACK || e->depth == MAXDEPTH) return error(L, e, "recursion detected");
+	if (lua_getmetatable(L, idx)) return error(L, e, "table with metatable unexpected");
+	checkStack(L);
+	type = getTableType(L, idx, &len);
+	if ((ref = findRef(L, idx, e->oidx, &e->nobjs)) != -1) {
+		checkWrite(L, amf3_writeRef(e->w, type, ref));
+		return 0;
+	}
+	switch (type) {
+		case AMF3_ARRAY:
+			checkWrite(L, amf3_writeArray(e->w, len));
+			break;
+		case AMF3_OBJECT:
+			checkWrite(L, amf3_writeObject(e->w));
+			lua_pushnil(L); /* First key */
+			break;
+		case AMF3_BYTEARRAY: /* Sent by reference to the table, so the data itself is never hashed */
+			lua_getfield(L, idx, "__bytes");
+			checkWrite(L, amf3_writeByteArray(e->w, lua_tostring(L, -1), len)); /* Large blocks go directly to the sink if there is one */
+			lua_pop(L, 1);
+			return 0;
+		default:
+			checkWrite(L, amf3_writeDictionary(e->w, len));
+			lua_pushnil(L); /* First key */
+			break;
+	}
+	f = e->frames + e->depth++;
+	f->type = type;
+	f->base = base;
+	f->idx = idx;
+	f->len = len;
+	f->index = 0;
+	f->keys = e->nkeys;
+	f->nkeys = 0;
+	f->key = 0;
+	if (e->kidx && type != AMF3_ARRAY) sortKeys(L, e, f);
+	return 1;
+}
+
+typedef struct {
+	long refs; /* Reference counter shared by all Lua states */
+	int ref; /* Value can be sent by reference */
+	int nstrs, nobjs; /* Number of referenceable strings/objects in the data */
+	int traits; /* Traits are defined in the data */
+	int sorted; /* Keys are encoded in canonical order */
+	size_t size;
+	char data[1];
+} Frozen;
+
+typedef struct {
+	Frozen *f;
+	int proxy; /* Table is an empty stand-in returned by 'amf3.shared' */
+} FrozenBox;
+
+#ifdef _WIN32
+#define atomicInc(p) InterlockedIncrement(p)
+#define atomicDec(p) InterlockedDecrement(p)
+#define atomicSwap(p, v) InterlockedExchange(p, v)
+#else
+#define atomicInc(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#define atomicDec(p) __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#define atomicSwap(p, v) __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL)
+#endif
+
+static Frozen *retainFrozen(Frozen *f) {
+	atomicInc(&f->refs);
+	return f;
+}
+
+static void releaseFrozen(Frozen *f) {
+	if (f && !atomicDec(&f->refs)) amf3_defaultAlloc(0, f, offsetof(Frozen, data) + f->size, 0);
+}
+
+static int freeFrozen(lua_State *L) {
+	FrozenBox *box = lua_touserdata(L, 1);
+	releaseFrozen(box->f);
+	box->f = 0;
+	return 0;
+}
+
+static FrozenBox *newFrozen(lua_State *L, int proxy) { /* Pushes an empty box for a reference to frozen data */
+	FrozenBox *box = lua_newuserdata(L, sizeof *box);
+	box->f = 0;
+	box->proxy = proxy;
+	if (luaL_newmetatable(L, MODNAME ".frozen")) {
+		lua_pushcfunction(L, freeFrozen);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	return box;
+}
+
+static int encodeFrozen(lua_State *L, Encoder *e, int idx) { /* Returns 0 if the table must be traversed, or -1 and pushes message */
+	const Frozen *f;
+	FrozenBox *box;
+	int ref;
+	lua_pushvalue(L, idx);
+	lua_rawget(L, e->fidx);
+	box = lua_touserdata(L, -1); /* Kept alive by the table being encoded */
+	lua_pop(L, 1);
+	if (!box || !(f = box->f)) return 0;
+	if (e->kidx && !f->sorted) { /* Table is traversed again unless there is nothing to traverse */
+		if (box->proxy) return error(L, e, "shared table is not canonical");
+		return 0;
+	}
+	if (f->ref && (ref = findRef(L, idx, e->oidx, &e->nobjs)) != -1) {
+		checkWrite(L, amf3_writeRef(e->w, *f->data, ref)); /* Same value type */
+		return 1;
+	}
+	encodeData(L, e->w, f->data, f->size);
+	skipRefs(L, &e->nstrs, f->nstrs);
+	skipRefs(L, &e->nobjs, f->nobjs - f->ref); /* The value itself has been registered above */
+	if (f->traits) e->w->traits = 1;
+	return 1;
+}
+
+static int encodeValue(lua_State *L, Encoder *e) { /* Encodes value on top of the stack; returns 1 if it is a table to be traversed */
+	int base = lua_gettop(L), idx = base, res;
+	if (e->fidx && lua_istable(L, idx) && (res = encodeFrozen(L, e, idx))) {
+		if (res == -1) return -1;
+		goto done;
+	}
+	if (luaL_callmeta(L, idx, e->ev)) ++idx; /* Transform value */
 	switch (lua_type(L, idx)) {
 		case LUA_TNIL:
-			encodeByte(L, box, AMF3_UNDEFINED);
+			checkWrite(L, amf3_writeUndefined(e->w));
 			break;
 		case LUA_TBOOLEAN:
-			encodeByte(L, box, lua_toboolean(L, idx) ? AMF3_TRUE : AMF3_FALSE);
+			checkWrite(L, amf3_writeBoolean(e->w, lua_toboolean(L, idx)));
 			break;
 		case LUA_TNUMBER: {
 			lua_Integer i;
-			if (isInteger(L, idx, &i) && i >= AMF3_INT_MIN && i <= AMF3_INT_MAX) {
-				encodeByte(L, box, AMF3_INTEGER);
-				encodeU29(L, box, i);
-			} else {
-				encodeByte(L, box, AMF3_DOUBLE);
-				encodeDouble(L, box, lua_tonumber(L, idx));
-			}
+			if (isInteger(L, idx, &i)) checkWrite(L, amf3_writeInteger(e->w, i)); /* Falls back to double if out of range */
+			else checkWrite(L, amf3_writeNumber(e->w, lua_tonumber(L, idx)));
 			break;
 		}
 		case LUA_TSTRING:
-			encodeByte(L, box, AMF3_STRING);
-			encodeString(L, box, idx, sidx);
+			encodeString(L, e, idx, 0);
+			break;
+		case LUA_TTABLE:
+			if ((res = encodeTable(L, e, base, idx))) return res;
 			break;
-		case LUA_TTABLE: {
-			int len, top = lua_gettop(L);
-			if (top >= MAXSTACK) return error(L, nerr, "recursion detected");
-			if (lua_getmetatable(L, idx)) return error(L, nerr, "table with metatable unexpected");
-			checkStack(L);
-			switch (getTableType(L, idx, &len)) {
-				case LUA_TNUMBER:
-					encodeByte(L, box, AMF3_ARRAY);
-					return encodeArray(L, box, idx, ev, sidx, oidx, tf, nerr, len, top);
-				case LUA_TSTRING:
-					encodeByte(L, box, AMF3_OBJECT);
-					return encodeObject(L, box, idx, ev, sidx, oidx, tf, nerr, top);
-				default:
-					encodeByte(L, box, AMF3_DICTIONARY);
-					return encodeDictionary(L, box, idx, ev, sidx, oidx, tf, nerr, len, top);
-			}
-		}
 		case LUA_TLIGHTUSERDATA:
 			if (!lua_touserdata(L, idx)) {
-				encodeByte(L, box, AMF3_NULL);
+				checkWrite(L, amf3_writeNull(e->w));
 				break;
 			} /* Fall through */
 		default:
-			return error(L, nerr, "%s unexpected", luaL_typename(L, idx));
+			return error(L, e, "%s unexpected", luaL_typename(L, idx));
+	}
+done:
+	lua_settop(L, base - 1);
+	return 0;
+}
+
+static int nextItem(lua_State *L, Encoder *e, Frame *f) { /* Pushes next item of the current table */
+	switch (f->type) {
+		case AMF3_ARRAY:
+			if (f->index == f->len) return 0;
+			lua_rawgeti(L, f->idx, ++f->index);
+			return 1;
+		case AMF3_OBJECT:
+			if (!nextKey(L, e, f)) {
+				checkWrite(L, amf3_writeObjectEnd(e->w));
+				return 0;
+			}
+			encodeString(L, e, f->idx + 1, 1);
+			return 1;
+		default:
+			if (f->index) { /* Value is on top of the stack */
+				f->index = 0;
+				return 1;
+			}
+			if (!nextKey(L, e, f)) return 0;
+			lua_pushvalue(L, -2);
+			f->index = 1;
+			return 1;
+	}
+}
+
+static int encodeValues(lua_State *L, Encoder *e, int budget) {
+	/* Encodes values starting with the one on top of the stack until everything is encoded (returns 1),
+	** 'budget' values have been encoded (returns 0), or an error occurs (returns -1 and pushes message).
+	** A negative 'budget' means no limit. */
+	for (;;) {
+		if (!budget) return 0;
+		if (budget > 0) --budget;
+		if (encodeValue(L, e) == -1) return -1;
+		for (;;) {
+			Frame *f;
+			if (!e->depth) return 1;
+			f = e->frames + e->depth - 1;
+			if (nextItem(L, e, f)) break;
+			lua_settop(L, f->base - 1);
+			e->nkeys = f->keys;
+			--e->depth;
+		}
+	}
+}
+
+static void initEncoder(Encoder *e, amf3_Writer *w, const char *ev) {
+	e->w = w;
+	e->ev = ev;
+	e->sidx = 0;
+	e->oidx = 0;
+	e->nstrs = 0;
+	e->nobjs = 0;
+	e->fidx = 0;
+	e->kidx = 0;
+	e->cidx = 0;
+	e->cache = 0;
+	e->keys = 0;
+	e->nkeys = 0;
+	e->ckeys = 0;
+	e->depth = 0;
+}
+
+static void pushFrozen(lua_State *L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, MODNAME ".frozen_tables");
+	if (lua_istable(L, -1)) return;
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, MODNAME ".frozen_tables");
+}
+
+static void pushEncoder(lua_State *L, Encoder *e, int sorted) { /* Pushes reference tables, frozen tables and key table */
+	int idx = lua_gettop(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	pushFrozen(L);
+	e->sidx = idx + 1;
+	e->oidx = idx + 2;
+	lua_pushnil(L);
+	if (lua_next(L, idx + 3)) { /* Look up frozen tables only if there are any */
+		lua_pop(L, 2);
+		e->fidx = idx + 3;
+	}
+	if (!sorted) {
+		lua_pushnil(L);
+		return;
 	}
+	lua_newtable(L); /* Key buffer is allocated on demand */
+	e->kidx = idx + 4;
+}
+
+int amf3__encode(lua_State *L) {
+	Encoder e;
+	const char *ev = luaL_optstring(L, 2, "__toAMF3");
+	luaL_checkany(L, 1);
+	lua_settop(L, 3);
+	initEncoder(&e, newWriter(L), ev);
+	pushEncoder(L, &e, lua_toboolean(L, 3));
+	lua_pushvalue(L, 1);
+	if (encodeValues(L, &e, -1) == -1) return luaL_argerror(L, 1, lua_tostring(L, -1));
+	lua_pushlstring(L, e.w->buf, e.w->pos);
 	return 1;
 }
 
-static int encodeValue(lua_State *L, Box *box, int idx, const char *ev, int sidx, int oidx, int *tf, int *nerr) {
-	int top = luaL_callmeta(L, idx, ev); /* Transform value */
-	if (!encodeValueData(L, box, top ? lua_gettop(L) : idx, ev, sidx, oidx, tf, nerr)) return 0;
-	if (top) lua_pop(L, 1); /* Remove modified value */
+static void *scratchAlloc(void *ud, void *ptr, size_t osize, size_t nsize) { /* Hands out buffer 'ud' of SCRATCH bytes */
+	return nsize && nsize <= SCRATCH ? ud : 0;
+}
+
+static int skipData(void *ud, const char *data, size_t size) {
+	return 0;
+}
+
+static int hashData(void *ud, const char *data, size_t size) { /* 64-bit FNV-1a */
+	uint64_t h = *(uint64_t *)ud;
+	size_t i;
+	for (i = 0; i < size; ++i) h = (h ^ (unsigned char)data[i]) * 0x100000001b3;
+	*(uint64_t *)ud = h;
+	return 0;
+}
+
+static void encodeScratch(lua_State *L, amf3_Writer *w, amf3_Sink sinkf, void *ud) { /* Passes encoded data to 'sinkf' in small blocks */
+	char buf[SCRATCH];
+	Encoder e;
+	const char *ev = luaL_optstring(L, 2, "__toAMF3");
+	luaL_checkany(L, 1);
+	lua_settop(L, 3);
+	amf3_initWriter(w, scratchAlloc, buf);
+	checkWrite(L, amf3_setSink(w, sinkf, ud, SCRATCH));
+	initEncoder(&e, w, ev);
+	pushEncoder(L, &e, lua_toboolean(L, 3));
+	lua_pushvalue(L, 1);
+	if (encodeValues(L, &e, -1) == -1) luaL_argerror(L, 1, lua_tostring(L, -1));
+	checkWrite(L, amf3_flush(w)); /* Buffer must not be used afterwards */
+}
+
+int amf3__size(lua_State *L) {
+	amf3_Writer w;
+	encodeScratch(L, &w, skipData, 0);
+	lua_pushinteger(L, w.total);
 	return 1;
 }
 
-int amf3__encode(lua_State *L) {
-	Box *box;
-	int tf = 0, nerr = 0;
+int amf3__hash(lua_State *L) {
+	amf3_Writer w;
+	uint64_t h = 0xcbf29ce484222325;
+	char str[17];
+	encodeScratch(L, &w, hashData, &h);
+	snprintf(str, sizeof str, "%08lx%08lx", (unsigned long)(h >> 32), (unsigned long)(h & 0xffffffff));
+	lua_pushstring(L, str);
+	return 1;
+}
+
+static void checkProxy(lua_State *L, int fidx, const char *what) { /* Proxy data must not be replaced by its empty table */
+	FrozenBox *box;
+	lua_pushvalue(L, 1);
+	lua_rawget(L, fidx);
+	box = lua_touserdata(L, -1);
+	if (box && box->proxy) luaL_argerror(L, 1, lua_pushfstring(L, "cannot %s a shared proxy", what));
+	lua_pop(L, 1);
+}
+
+int amf3__freeze(lua_State *L) {
+	Encoder e;
+	Frozen *f;
+	FrozenBox *box;
+	const char *ev = luaL_optstring(L, 2, "__toAMF3");
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 3);
+	pushFrozen(L);
+	checkProxy(L, 4, "freeze");
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	lua_rawset(L, 4); /* Drop previously encoded data */
+	lua_newtable(L); /* Key table */
+	initEncoder(&e, newWriter(L), ev); /* Self-contained encoding */
+	e.fidx = 4;
+	if (lua_toboolean(L, 3)) e.kidx = 5;
+	lua_pushvalue(L, 1);
+	if (encodeValues(L, &e, -1) == -1) return luaL_argerror(L, 1, lua_tostring(L, -1));
+	box = newFrozen(L, 0);
+	if (!(box->f = f = amf3_defaultAlloc(0, 0, 0, offsetof(Frozen, data) + e.w->pos))) return luaL_error(L, "cannot allocate memory");
+	f->refs = 1;
+	switch (*e.w->buf) {
+		case AMF3_ARRAY:
+		case AMF3_OBJECT:
+		case AMF3_DICTIONARY:
+			f->ref = 1;
+			break;
+		default: /* Transformed into a non-table value */
+			f->ref = 0;
+			break;
+	}
+	f->nstrs = e.nstrs;
+	f->nobjs = e.nobjs;
+	f->traits = e.w->traits;
+	f->sorted = e.kidx != 0;
+	f->size = e.w->pos;
+	memcpy(f->data, e.w->buf, e.w->pos);
+	lua_pushvalue(L, 1);
+	lua_insert(L, -2);
+	lua_rawset(L, 4);
+	lua_settop(L, 1);
+	return 1;
+}
+
+typedef struct Shared Shared;
+
+struct Shared {
+	Shared *next;
+	Frozen *f;
+	size_t len;
+	char name[1];
+};
+
+static Shared *shared; /* Frozen data shared by all Lua states */
+static long lock;
+
+static void lockShared(void) {
+	while (atomicSwap(&lock, 1)); /* Spin, since the lock is only held for a list lookup */
+}
+
+static void unlockShared(void) {
+	atomicSwap(&lock, 0);
+}
+
+static Shared **findShared(const char *name, size_t len) {
+	Shared **s;
+	for (s = &shared; *s; s = &(*s)->next) {
+		if ((*s)->len == len && !memcmp((*s)->name, name, len)) break;
+	}
+	return s;
+}
+
+int amf3__share(lua_State *L) {
+	size_t len;
+	const char *name = luaL_checklstring(L, 1, &len);
+	Shared **s, *old, *new = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		FrozenBox *box;
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_settop(L, 2);
+		pushFrozen(L);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, 3);
+		box = lua_touserdata(L, 4);
+		luaL_argcheck(L, box && box->f, 2, "table is not frozen");
+		if (!(new = amf3_defaultAlloc(0, 0, 0, offsetof(Shared, name) + len))) return luaL_error(L, "cannot allocate memory");
+		new->f = retainFrozen(box->f);
+		new->len = len;
+		memcpy(new->name, name, len);
+	}
+	lockShared();
+	s = findShared(name, len);
+	if ((old = *s)) *s = old->next;
+	if (new) {
+		new->next = shared;
+		shared = new;
+	}
+	unlockShared();
+	if (old) {
+		releaseFrozen(old->f);
+		amf3_defaultAlloc(0, old, offsetof(Shared, name) + old->len, 0);
+	}
+	return 0;
+}
+
+int amf3__shared(lua_State *L) {
+	size_t len;
+	const char *name = luaL_checklstring(L, 1, &len);
+	FrozenBox *box;
+	Shared *s;
+	lua_settop(L, 1);
+	pushFrozen(L);
+	lua_newtable(L);
+	box = newFrozen(L, 1);
+	lockShared();
+	if ((s = *findShared(name, len))) box->f = retainFrozen(s->f);
+	unlockShared();
+	if (!box->f) return 0;
+	lua_pushvalue(L, 3);
+	lua_insert(L, -2);
+	lua_rawset(L, 2); /* New table is frozen with shared data */
+	return 1;
+}
+
+int amf3__thaw(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	pushFrozen(L);
+	checkProxy(L, 2, "thaw");
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	lua_rawset(L, 2);
+	lua_settop(L, 1);
+	return 1;
+}
+
+typedef struct {
+	Encoder e;
+	int ref; /* Job's stack saved between steps */
+} EncodeJob;
+
+static EncodeJob *checkEncodeJob(lua_State *L) {
+	return luaL_checkudata(L, 1, MODNAME ".encode_job");
+}
+
+static int stepEncodeJob(lua_State *L) {
+	EncodeJob *j = checkEncodeJob(L);
+	int res, budget = amf3__checkBudget(L, 2);
+	if (j->ref == LUA_NOREF) return luaL_error(L, "job is finished");
+	lua_settop(L, 2);
+	amf3__restoreStack(L, &j->ref); /* Job is finished unless the step completes normally */
+	res = encodeValues(L, &j->e, budget);
+	if (res == -1) return lua_error(L);
+	if (res) {
+		lua_pushboolean(L, 1);
+		lua_pushlstring(L, j->e.w->buf, j->e.w->pos);
+		return 2;
+	}
+	amf3__saveStack(L, &j->ref, 3);
+	lua_pushboolean(L, 0);
+	return 1;
+}
+
+static int freeEncodeJob(lua_State *L) {
+	luaL_unref(L, LUA_REGISTRYINDEX, checkEncodeJob(L)->ref);
+	return 0;
+}
+
+int amf3__encode_job(lua_State *L) {
+	EncodeJob *j;
 	const char *ev = luaL_optstring(L, 2, "__toAMF3");
 	luaL_checkany(L, 1);
+	lua_settop(L, 3);
+	j = lua_newuserdata(L, sizeof *j);
+	j->ref = LUA_NOREF;
+	if (luaL_newmetatable(L, MODNAME ".encode_job")) {
+		lua_pushcfunction(L, stepEncodeJob);
+		lua_setfield(L, -2, "step");
+		lua_pushcfunction(L, freeEncodeJob);
+		lua_setfield(L, -2, "__gc");
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	lua_insert(L, 1); /* Event is kept alive at index 3 */
+	initEncoder(&j->e, newWriter(L), ev);
+	pushEncoder(L, &j->e, lua_toboolean(L, 4));
+	lua_pushvalue(L, 2);
+	amf3__saveStack(L, &j->ref, 3); /* Same layout as in 'stepEncodeJob' */
+	lua_settop(L, 1);
+	return 1;
+}
+
+static KeyCache *checkKeyCache(lua_State *L) {
+	return luaL_checkudata(L, 1, MODNAME ".encoder");
+}
+
+static int encodeMessage(lua_State *L) { /* Returns encoded value, or 'nil' and error message */
+	KeyCache *c = lua_touserdata(L, 1);
+	Encoder e;
+	int cached = lua_toboolean(L, 3);
 	lua_settop(L, 2);
-	lua_newtable(L);
-	lua_newtable(L);
-	if (!encodeValue(L, box = newBox(L), 1, ev, 3, 4, &tf, &nerr)) {
-		lua_concat(L, nerr);
-		return luaL_argerror(L, 1, lua_tostring(L, -1));
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	if (cached && !++c->serial) { /* Serial number wrapped around */
+		for (lua_pushnil(L); lua_next(L, 3); lua_pop(L, 1)) ((CachedKey *)lua_touserdata(L, -1))->serial = 0;
+		c->serial = 1;
+	}
+	initEncoder(&e, newWriter(L), c->ev);
+	pushEncoder(L, &e, c->sorted);
+	if (cached) {
+		e.cidx = 3;
+		e.cache = c;
+	}
+	lua_pushvalue(L, 2);
+	if (encodeValues(L, &e, -1) == -1) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
 	}
-	lua_pushlstring(L, box->buf, box->pos);
+	lua_pushlstring(L, e.w->buf, e.w->pos);
+	return 1;
+}
+
+static int encodeWithCache(lua_State *L) {
+	KeyCache *c = checkKeyCache(L);
+	int res, owner = !c->busy; /* Nested message is encoded without the cache, since its serial is taken */
+	luaL_checkany(L, 2);
+	lua_settop(L, 2);
+	lua_pushcfunction(L, encodeMessage);
+	lua_insert(L, 1);
+	lua_pushboolean(L, owner);
+	c->busy = 1;
+	res = lua_pcall(L, 3, 2, 0);
+	if (owner) c->busy = 0;
+	if (res) return lua_error(L);
+	if (lua_isnil(L, -2)) return luaL_argerror(L, 2, lua_tostring(L, -1));
+	lua_pop(L, 1);
+	return 1;
+}
+
+static int freeKeyCache(lua_State *L) {
+	luaL_unref(L, LUA_REGISTRYINDEX, checkKeyCache(L)->ref);
+	return 0;
+}
+
+int amf3__encoder(lua_State *L) {
+	KeyCache *c;
+	size_t len;
+	const char *ev = luaL_optlstring(L, 1, "__toAMF3", &len);
+	lua_Integer size = luaL_optinteger(L, 3, 1024);
+	checkRange(L, size >= 0 && size <= INT_MAX, 3);
+	c = lua_newuserdata(L, offsetof(KeyCache, ev) + len + 1);
+	c->serial = 0;
+	c->ref = LUA_NOREF;
+	c->size = size;
+	c->count = 0;
+	c->sorted = lua_toboolean(L, 2);
+	c->busy = 0;
+	memcpy(c->ev, ev, len + 1);
+	if (luaL_newmetatable(L, MODNAME ".encoder")) {
+		lua_pushcfunction(L, encodeWithCache);
+		lua_setfield(L, -2, "encode");
+		lua_pushcfunction(L, freeKeyCache);
+		lua_setfield(L, -2, "__gc");
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	c->ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	return 1;
 }
 
 int amf3__pack(lua_State *L) {
 	const char *fmt = luaL_checkstring(L, 1);
 	int arg, opt, top = lua_gettop(L);
-	Box *box = newBox(L);
+	amf3_Writer *w = newWriter(L);
 	for (arg = 2; (opt = *fmt++); ++arg) {
 		if (arg > top) return luaL_argerror(L, arg, "value expected");
 		switch (opt) {
 			case 'b': {
 				lua_Integer i = luaL_checkinteger(L, arg);
 				checkRange(L, i >= 0 && i <= UINT8_MAX, arg);
-				encodeByte(L, box, i);
+				encodeByte(L, w, i);
 				break;
 			}
 			case 'i': {
 				lua_Integer i = luaL_checkinteger(L, arg);
 				checkRange(L, i >= AMF3_INT_MIN && i <= AMF3_INT_MAX, arg);
-				encodeU29(L, box, i);
+				encodeU29(L, w, i);
 				break;
 			}
 			case 'I': {
 				lua_Integer i = luaL_checkinteger(L, arg); /* May overflow */
 				lua_Number n = lua_tonumber(L, arg);
 				checkRange(L, n >= INT32_MIN && n <= INT32_MAX, arg);
-				encodeU32(L, box, i);
+				encodeU32(L, w, i);
 				break;
 			}
 			case 'u': {
 				lua_Integer i = luaL_checkinteger(L, arg);
 				checkRange(L, i >= 0 && i <= AMF3_U29_MAX, arg);
-				encodeU29(L, box, i);
+				encodeU29(L, w, i);
 				break;
 			}
 			case 'U': {
 				lua_Integer i = luaL_checkinteger(L, arg); /* May overflow */
 				lua_Number n = lua_tonumber(L, arg);
 				checkRange(L, n >= 0 && n <= UINT32_MAX, arg);
-				encodeU32(L, box, i);
+				encodeU32(L, w, i);
 				break;
 			}
 			case 'f':
-				encodeFloat(L, box, luaL_checknumber(L, arg));
+				checkWrite(L, amf3_writeFloat(w, luaL_checknumber(L, arg)));
 				break;
 			case 'd':
-				encodeDouble(L, box, luaL_checknumber(L, arg));
+				checkWrite(L, amf3_writeDouble(w, luaL_checknumber(L, arg)));
 				break;
 			case 's': {
 				size_t len;
 				const char *str = luaL_checklstring(L, arg, &len);
 				luaL_argcheck(L, len <= AMF3_U29_MAX, arg, "string too long");
-				encodeU29(L, box, len);
-				encodeData(L, box, str, len);
+				encodeU29(L, w, len);
+				encodeData(L, w, str, len);
 				break;
 			}
 			case 'S': {
 				size_t len;
 				const char *str = luaL_checklstring(L, arg, &len);
 				luaL_argcheck(L, len <= UINT32_MAX, arg, "string too long");
-				encodeU32(L, box, len);
-				encodeData(L, box, str, len);
+				encodeU32(L, w, len);
+				encodeData(L, w, str, len);
 				break;
 			}
 			default:
 				return luaL_error(L, "invalid format option '%c'", opt);
 		}
 	}
-	lua_pushlstring(L, box->buf, box->pos);
+	lua_pushlstring(L, w->buf, w->pos);
 	return 1;
 }
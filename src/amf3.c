@@ -20,16 +20,58 @@
 ** THE SOFTWARE.
 */
 
+#include <limits.h>
 #include "amf3.h"
 
 static const luaL_Reg funcs[] = {
 	{"encode", amf3__encode},
 	{"decode", amf3__decode},
+	{"decode_columns", amf3__decode_columns},
+	{"freeze", amf3__freeze},
+	{"thaw", amf3__thaw},
+	{"share", amf3__share},
+	{"shared", amf3__shared},
+	{"size", amf3__size},
+	{"hash", amf3__hash},
+	{"encode_job", amf3__encode_job},
+	{"encoder", amf3__encoder},
+	{"decode_job", amf3__decode_job},
 	{"pack", amf3__pack},
 	{"unpack", amf3__unpack},
+	{"delta", amf3__delta},
+	{"apply_delta", amf3__apply_delta},
 	{0, 0}
 };
 
+int amf3__checkBudget(lua_State *L, int arg) { /* Returns a job step budget at 'arg' or -1 if there is no limit */
+	lua_Integer budget;
+	if (lua_isnoneornil(L, arg)) return -1;
+	budget = luaL_checkinteger(L, arg);
+	checkRange(L, budget >= 1, arg);
+	return budget < INT_MAX ? (int)budget : -1; /* Larger budgets are never exhausted */
+}
+
+void amf3__saveStack(lua_State *L, int *ref, int idx) { /* Moves values starting at 'idx' to a new thread stored in 'ref' */
+	int n = lua_gettop(L) - idx + 1;
+	lua_State *T = lua_newthread(L);
+	if (!lua_checkstack(T, n)) luaL_error(L, "too many nested values");
+	lua_insert(L, idx);
+	lua_xmove(L, T, n);
+	*ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+void amf3__restoreStack(lua_State *L, int *ref) { /* Moves values back from the thread stored in 'ref' and releases it */
+	int idx = lua_gettop(L) + 1;
+	lua_State *T;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, *ref);
+	T = lua_tothread(L, idx);
+	luaL_checkstack(L, lua_gettop(T), "too many nested values");
+	lua_xmove(T, L, lua_gettop(T));
+	lua_remove(L, idx);
+	luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+	*ref = LUA_NOREF;
+}
+
 int luaopen_amf3(lua_State *L) {
 #if LUA_VERSION_NUM < 502
 	luaL_register(L, "amf3", funcs);
@@ -23,33 +23,11 @@
 #pragma once
 
 #include <lauxlib.h>
+#include "libamf3.h"
 
 #define MODNAME "lua-amf3"
 #define VERSION "2.0.5"
 
-#define AMF3_UNDEFINED     0x00
-#define AMF3_NULL          0x01
-#define AMF3_FALSE         0x02
-#define AMF3_TRUE          0x03
-#define AMF3_INTEGER       0x04
-#define AMF3_DOUBLE        0x05
-#define AMF3_STRING        0x06
-#define AMF3_XMLDOC        0x07
-#define AMF3_DATE          0x08
-#define AMF3_ARRAY         0x09
-#define AMF3_OBJECT        0x0a
-#define AMF3_XML           0x0b
-#define AMF3_BYTEARRAY     0x0c
-#define AMF3_VECTOR_INT    0x0d
-#define AMF3_VECTOR_UINT   0x0e
-#define AMF3_VECTOR_DOUBLE 0x0f
-#define AMF3_VECTOR_OBJECT 0x10
-#define AMF3_DICTIONARY    0x11
-
-#define AMF3_INT_MIN -268435456
-#define AMF3_INT_MAX 268435455
-#define AMF3_U29_MAX (AMF3_INT_MAX - AMF3_INT_MIN)
-
 #define checkStack(L) luaL_checkstack(L, LUA_MINSTACK, "too many nested values")
 #define checkRange(L, cond, arg) luaL_argcheck(L, cond, arg, "value out of range")
 
@@ -71,10 +49,31 @@ EXPORT int luaopen_amf3(lua_State *L);
 
 int amf3__encode(lua_State *L);
 int amf3__decode(lua_State *L);
+int amf3__decode_columns(lua_State *L);
+
+int amf3__freeze(lua_State *L);
+int amf3__thaw(lua_State *L);
+int amf3__share(lua_State *L);
+int amf3__shared(lua_State *L);
+
+int amf3__size(lua_State *L);
+int amf3__hash(lua_State *L);
+
+int amf3__encode_job(lua_State *L);
+int amf3__encoder(lua_State *L);
+int amf3__decode_job(lua_State *L);
 
 int amf3__pack(lua_State *L);
 int amf3__unpack(lua_State *L);
 
+int amf3__delta(lua_State *L);
+int amf3__apply_delta(lua_State *L);
+
+int amf3__checkBudget(lua_State *L, int arg);
+
+void amf3__saveStack(lua_State *L, int *ref, int idx);
+void amf3__restoreStack(lua_State *L, int *ref);
+
 #ifndef _WIN32
 #pragma GCC visibility pop
 #endif
@@ -0,0 +1,399 @@
+/*
+** Copyright (C) 2012-2020 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "libamf3.h"
+
+static int error(amf3_Reader *r, int res, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(r->msg, sizeof r->msg, fmt, ap);
+	va_end(ap);
+	return res;
+}
+
+static void *growArray(amf3_Reader *r, void *arr, int *cap, size_t size) {
+	int n = *cap ? *cap << 1 : 16;
+	if (n < 0 || !(arr = r->allocf(r->allocud, arr, *cap * size, n * size))) return 0;
+	*cap = n;
+	return arr;
+}
+
+#define checkSpace(r, arr, n, cap) do { \
+	if ((n) >= (cap)) { \
+		void *arr_ = growArray(r, arr, &(cap), sizeof *(arr)); \
+		if (!arr_) return error(r, AMF3_EMEM, "cannot allocate memory"); \
+		(arr) = arr_; \
+	} \
+} while (0)
+
+static void decodeEndianData(const char *buf, char *data, size_t size) {
+	size_t i = 1;
+	if (!*(char *)&i) memcpy(data, buf, size); /* Big-endian */
+	else for (i = 0; i < size; ++i) data[i] = buf[size - i - 1]; /* Little-endian */
+}
+
+void amf3_initReader(amf3_Reader *r, const char *buf, size_t size, amf3_Alloc allocf, void *ud) {
+	memset(r, 0, sizeof *r);
+	r->buf = buf;
+	r->size = size;
+	r->allocf = allocf ? allocf : amf3_defaultAlloc;
+	r->allocud = ud;
+}
+
+void amf3_freeReader(amf3_Reader *r) {
+	r->allocf(r->allocud, r->strs, r->cstrs * sizeof *r->strs, 0);
+	r->allocf(r->allocud, r->names, r->cnames * sizeof *r->names, 0);
+	r->allocf(r->allocud, r->traits, r->ctraits * sizeof *r->traits, 0);
+	r->allocf(r->allocud, r->frames, r->cframes * sizeof *r->frames, 0);
+	r->strs = r->names = 0;
+	r->traits = 0;
+	r->frames = 0;
+	r->nstrs = r->nnames = r->ntraits = r->nframes = r->nobjs = 0;
+	r->cstrs = r->cnames = r->ctraits = r->cframes = 0;
+}
+
+int amf3_depth(const amf3_Reader *r) {
+	return r->nframes;
+}
+
+int amf3_readByte(amf3_Reader *r, int *val) {
+	if (r->pos >= r->size) return error(r, AMF3_EDATA, "insufficient data at position %lu", (unsigned long)r->pos + 1);
+	*val = r->buf[r->pos++] & 0xff;
+	return AMF3_OK;
+}
+
+int amf3_readU29(amf3_Reader *r, int *val) {
+	const char *buf = r->buf + r->pos;
+	int len = 0, x = 0;
+	unsigned char c;
+	do {
+		if (r->pos + len >= r->size) return error(r, AMF3_EDATA, "insufficient U29 data at position %lu", (unsigned long)r->pos + 1);
+		c = buf[len++];
+		if (len == 4) {
+			x <<= 8;
+			x |= c;
+			break;
+		}
+		x <<= 7;
+		x |= c & 0x7f;
+	} while (c & 0x80);
+	r->pos += len;
+	*val = x;
+	return AMF3_OK;
+}
+
+int amf3_readU32(amf3_Reader *r, uint32_t *val) {
+	if (r->pos + 4 > r->size) return error(r, AMF3_EDATA, "insufficient U32 data at position %lu", (unsigned long)r->pos + 1);
+	decodeEndianData(r->buf + r->pos, (char *)val, 4);
+	r->pos += 4;
+	return AMF3_OK;
+}
+
+int amf3_readFloat(amf3_Reader *r, float *val) {
+	if (r->pos + 4 > r->size) return error(r, AMF3_EDATA, "insufficient IEEE-754 data at position %lu", (unsigned long)r->pos + 1);
+	decodeEndianData(r->buf + r->pos, (char *)val, 4);
+	r->pos += 4;
+	return AMF3_OK;
+}
+
+int amf3_readDouble(amf3_Reader *r, double *val) {
+	if (r->pos + 8 > r->size) return error(r, AMF3_EDATA, "insufficient IEEE-754 data at position %lu", (unsigned long)r->pos + 1);
+	decodeEndianData(r->buf + r->pos, (char *)val, 8);
+	r->pos += 8;
+	return AMF3_OK;
+}
+
+int amf3_readData(amf3_Reader *r, size_t size, const char **data) {
+	if (size > r->size - r->pos) return error(r, AMF3_EDATA, "insufficient data of length %lu at position %lu", (unsigned long)size, (unsigned long)r->pos + 1);
+	*data = r->buf + r->pos;
+	r->pos += size;
+	return AMF3_OK;
+}
+
+static int readRef(amf3_Reader *r, int *val, int *ref) {
+	int pfx = 0, res;
+	size_t pos = r->pos;
+	if ((res = amf3_readU29(r, &pfx))) return res;
+	if (pfx & 1) {
+		*val = pfx >> 1;
+		*ref = -1;
+		return AMF3_OK;
+	}
+	pfx >>= 1;
+	if (pfx >= r->nobjs) return error(r, AMF3_EREF, "invalid reference %d at position %lu", pfx, (unsigned long)pos + 1);
+	*ref = pfx;
+	return AMF3_OK;
+}
+
+static int readString(amf3_Reader *r, const char **data, size_t *size) {
+	int pfx = 0, res;
+	size_t pos = r->pos;
+	if ((res = amf3_readU29(r, &pfx))) return res;
+	if (!(pfx & 1)) { /* Reference */
+		pfx >>= 1;
+		if (pfx >= r->nstrs) return error(r, AMF3_EREF, "invalid reference %d at position %lu", pfx, (unsigned long)pos + 1);
+		*data = r->buf + r->strs[pfx].pos;
+		*size = r->strs[pfx].len;
+		return AMF3_OK;
+	}
+	pfx >>= 1;
+	if ((res = amf3_readData(r, pfx, data))) return res;
+	*size = pfx;
+	if (!pfx) return AMF3_OK; /* Empty string is never sent by reference */
+	checkSpace(r, r->strs, r->nstrs, r->cstrs);
+	r->strs[r->nstrs].pos = *data - r->buf;
+	r->strs[r->nstrs].len = pfx;
+	++r->nstrs;
+	return AMF3_OK;
+}
+
+static int beginContainer(amf3_Reader *r, amf3_Event *ev, int type, int len, int count, int traits) {
+	amf3_Frame *f;
+	checkSpace(r, r->frames, r->nframes, r->cframes);
+	f = &r->frames[r->nframes++];
+	f->type = type;
+	f->len = len;
+	f->count = count;
+	f->index = 0;
+	f->member = 0;
+	f->phase = 0;
+	f->traits = traits;
+	f->data = ev->data;
+	f->size = ev->size;
+	f->parent = ev->parent;
+	f->pindex = ev->index;
+	f->key = ev->key;
+	f->ksize = ev->ksize;
+	++r->nobjs;
+	ev->event = AMF3_EVENT_BEGIN;
+	ev->len = len;
+	return AMF3_OK;
+}
+
+static int readObject(amf3_Reader *r, amf3_Event *ev) {
+	amf3_Traits *t;
+	amf3_Span *s;
+	int pfx = 0, res, idx;
+	size_t pos = r->pos;
+	if ((res = readRef(r, &pfx, &ev->ref)) || ev->ref != -1) return res;
+	if (pfx & 1) { /* New traits */
+		int i, n = pfx >> 3;
+		checkSpace(r, r->traits, r->ntraits, r->ctraits);
+		idx = r->ntraits++;
+		r->traits[idx].pfx = pfx >> 1;
+		r->traits[idx].names = r->nnames;
+		for (i = 0; i <= n; ++i) { /* Class name and static member names */
+			const char *data;
+			size_t size;
+			if ((res = readString(r, &data, &size))) return res;
+			checkSpace(r, r->names, r->nnames, r->cnames);
+			r->names[r->nnames].pos = data - r->buf;
+			r->names[r->nnames].len = size;
+			++r->nnames;
+		}
+	} else { /* Existing traits */
+		idx = pfx >> 1;
+		if (idx >= r->ntraits) return error(r, AMF3_EREF, "invalid class reference %d at position %lu", idx, (unsigned long)pos + 1);
+	}
+	t = &r->traits[idx];
+	s = &r->names[t->names];
+	ev->traits = t->pfx & 3;
+	ev->data = r->buf + s->pos;
+	ev->size = s->len;
+	return beginContainer(r, ev, AMF3_OBJECT, t->pfx >> 2, t->pfx >> 2, idx);
+}
+
+static int readValue(amf3_Reader *r, amf3_Event *ev) {
+	int type = 0, val = 0, res;
+	size_t pos = r->pos;
+	if ((res = amf3_readByte(r, &type))) return res;
+	ev->event = AMF3_EVENT_VALUE;
+	ev->type = type;
+	ev->ref = -1;
+	ev->data = 0;
+	ev->size = 0;
+	switch (type) {
+		case AMF3_UNDEFINED:
+		case AMF3_NULL:
+		case AMF3_FALSE:
+		case AMF3_TRUE:
+			return AMF3_OK;
+		case AMF3_INTEGER:
+			if ((res = amf3_readU29(r, &val))) return res;
+			if (val & 0x10000000) val -= 0x20000000;
+			ev->ival = val;
+			return AMF3_OK;
+		case AMF3_DOUBLE:
+			return amf3_readDouble(r, &ev->num);
+		case AMF3_STRING:
+			return readString(r, &ev->data, &ev->size);
+		case AMF3_XML:
+		case AMF3_XMLDOC:
+		case AMF3_BYTEARRAY:
+			if ((res = readRef(r, &val, &ev->ref)) || ev->ref != -1) return res;
+			if ((res = amf3_readData(r, val, &ev->data))) return res;
+			ev->size = val;
+			++r->nobjs;
+			return AMF3_OK;
+		case AMF3_DATE:
+			if ((res = readRef(r, &val, &ev->ref)) || ev->ref != -1) return res;
+			if ((res = amf3_readDouble(r, &ev->num))) return res;
+			++r->nobjs;
+			return AMF3_OK;
+		case AMF3_ARRAY:
+			if ((res = readRef(r, &val, &ev->ref)) || ev->ref != -1) return res;
+			return beginContainer(r, ev, type, val, val, 0);
+		case AMF3_OBJECT:
+			return readObject(r, ev);
+		case AMF3_VECTOR_INT:
+		case AMF3_VECTOR_UINT:
+		case AMF3_VECTOR_DOUBLE:
+		case AMF3_VECTOR_OBJECT: {
+			int fixed;
+			if ((res = readRef(r, &val, &ev->ref)) || ev->ref != -1) return res;
+			if ((res = amf3_readByte(r, &fixed))) return res; /* 'fixed-vector' marker */
+			if (type == AMF3_VECTOR_OBJECT && (res = readString(r, &ev->data, &ev->size))) return res; /* 'object-type-name' marker */
+			return beginContainer(r, ev, type, val, val, 0);
+		}
+		case AMF3_DICTIONARY: {
+			int weak;
+			if ((res = readRef(r, &val, &ev->ref)) || ev->ref != -1) return res;
+			if ((res = amf3_readByte(r, &weak))) return res; /* 'weak-keys' marker */
+			return beginContainer(r, ev, type, val, val << 1, 0);
+		}
+		default:
+			return error(r, AMF3_ETYPE, "invalid value type %d at position %lu", type, (unsigned long)pos + 1);
+	}
+}
+
+static int readVectorItem(amf3_Reader *r, amf3_Event *ev, int type) {
+	uint32_t val = 0;
+	int res;
+	ev->event = AMF3_EVENT_VALUE;
+	ev->ref = -1;
+	if (type == AMF3_VECTOR_DOUBLE) {
+		ev->type = AMF3_DOUBLE;
+		return amf3_readDouble(r, &ev->num);
+	}
+	if ((res = amf3_readU32(r, &val))) return res;
+	ev->type = AMF3_INTEGER;
+	ev->ival = type == AMF3_VECTOR_INT ? (int64_t)(int32_t)val : (int64_t)val;
+	return AMF3_OK;
+}
+
+static int readKey(amf3_Reader *r, amf3_Event *ev) {
+	int res = readString(r, &ev->key, &ev->ksize);
+	if (!res && !ev->ksize) ev->key = 0; /* Empty key marks the end of members */
+	return res;
+}
+
+static int nextEvent(amf3_Reader *r, amf3_Event *ev) {
+	amf3_Frame *f;
+	int res;
+	ev->parent = 0;
+	ev->index = 0;
+	ev->key = 0;
+	ev->ksize = 0;
+	if (!r->nframes) return readValue(r, ev);
+	f = &r->frames[r->nframes - 1];
+	ev->parent = f->type;
+	ev->index = f->index;
+	switch (f->type) {
+		case AMF3_ARRAY:
+			if (!f->phase) { /* Associative part */
+				if ((res = readKey(r, ev))) return res;
+				if (ev->key) return readValue(r, ev);
+				f->phase = 1;
+			}
+			if (f->index < f->count) {
+				++f->index;
+				return readValue(r, ev);
+			}
+			break;
+		case AMF3_OBJECT: {
+			amf3_Traits *t = &r->traits[f->traits];
+			if (t->pfx & AMF3_TRAITS_EXTERNALIZABLE) {
+				if (!f->phase++) return readValue(r, ev);
+				break;
+			}
+			if (f->member < f->count) { /* Static members */
+				amf3_Span *s = &r->names[t->names + ++f->member];
+				ev->key = r->buf + s->pos;
+				ev->ksize = s->len;
+				return readValue(r, ev);
+			}
+			if (t->pfx & AMF3_TRAITS_DYNAMIC) { /* Dynamic members */
+				if ((res = readKey(r, ev))) return res;
+				if (ev->key) return readValue(r, ev);
+			}
+			break;
+		}
+		case AMF3_VECTOR_INT:
+		case AMF3_VECTOR_UINT:
+		case AMF3_VECTOR_DOUBLE:
+			if (f->index < f->count) {
+				++f->index;
+				return readVectorItem(r, ev, f->type);
+			}
+			break;
+		default: /* Vector of objects, dictionary */
+			if (f->index < f->count) {
+				++f->index;
+				return readValue(r, ev);
+			}
+			break;
+	}
+	ev->event = AMF3_EVENT_END;
+	ev->type = f->type;
+	ev->ref = -1;
+	ev->len = f->len;
+	ev->traits = f->type == AMF3_OBJECT ? r->traits[f->traits].pfx & 3 : 0;
+	ev->data = f->data;
+	ev->size = f->size;
+	ev->parent = f->parent;
+	ev->index = f->pindex;
+	ev->key = f->key;
+	ev->ksize = f->ksize;
+	--r->nframes;
+	return AMF3_OK;
+}
+
+static int checkLimits(amf3_Reader *r, const amf3_Event *ev, size_t pos) {
+	++r->nodes;
+	r->bytes += ev->size + ev->ksize;
+	if (r->maxnodes && r->nodes > r->maxnodes) return error(r, AMF3_ELIMIT, "too many values at position %lu", (unsigned long)pos + 1);
+	if (r->maxbytes && r->bytes > r->maxbytes) return error(r, AMF3_ELIMIT, "too much data at position %lu", (unsigned long)pos + 1);
+	if (ev->event != AMF3_EVENT_BEGIN) return AMF3_OK;
+	if (r->maxdepth && r->nframes > r->maxdepth) return error(r, AMF3_ELIMIT, "too many nested values at position %lu", (unsigned long)pos + 1);
+	if (r->maxlen && ev->len > r->maxlen) return error(r, AMF3_ELIMIT, "too many items at position %lu", (unsigned long)pos + 1);
+	return AMF3_OK;
+}
+
+int amf3_next(amf3_Reader *r, amf3_Event *ev) {
+	size_t pos = r->pos;
+	int res = nextEvent(r, ev);
+	if (res || ev->event == AMF3_EVENT_END) return res;
+	return checkLimits(r, ev, pos);
+}
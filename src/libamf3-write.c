@@ -0,0 +1,254 @@
+/*
+** Copyright (C) 2012-2020 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include <string.h>
+#include "libamf3.h"
+
+#define MINSIZE 100
+
+static int resize(amf3_Writer *w, size_t size) {
+	char *buf = w->allocf(w->allocud, w->buf, w->size, size);
+	if (!buf && size) return AMF3_EMEM;
+	w->buf = buf;
+	w->size = size;
+	return AMF3_OK;
+}
+
+static int reserve(amf3_Writer *w, size_t size, char **buf) {
+	size_t pos = w->pos;
+	size_t old = w->size;
+	size_t new = pos + size;
+	if (new > old) {
+		if (w->sinkf && pos) { /* Make room by flushing buffered data */
+			int res = amf3_flush(w);
+			if (res) return res;
+			pos = 0;
+			new = size;
+		}
+		if (new > old) { /* Expand buffer */
+			int res;
+			old <<= 1; /* At least twice the old size */
+			if (old < MINSIZE) old = MINSIZE;
+			if ((res = resize(w, new > old ? new : old))) return res;
+		}
+	}
+	w->pos = new;
+	*buf = w->buf + pos;
+	return AMF3_OK;
+}
+
+void amf3_initWriter(amf3_Writer *w, amf3_Alloc allocf, void *ud) {
+	w->buf = 0;
+	w->pos = 0;
+	w->size = 0;
+	w->total = 0;
+	w->allocf = allocf ? allocf : amf3_defaultAlloc;
+	w->allocud = ud;
+	w->sinkf = 0;
+	w->sinkud = 0;
+	w->traits = 0;
+}
+
+int amf3_setSink(amf3_Writer *w, amf3_Sink sinkf, void *ud, size_t size) {
+	int res = amf3_flush(w);
+	if (res) return res;
+	w->sinkf = sinkf;
+	w->sinkud = ud;
+	return size > w->size ? resize(w, size) : AMF3_OK;
+}
+
+int amf3_flush(amf3_Writer *w) {
+	if (!w->sinkf || !w->pos) return AMF3_OK;
+	if (w->sinkf(w->sinkud, w->buf, w->pos)) return AMF3_ESINK;
+	w->total += w->pos;
+	w->pos = 0;
+	return AMF3_OK;
+}
+
+void amf3_freeWriter(amf3_Writer *w) {
+	resize(w, 0);
+	w->pos = 0;
+}
+
+char *amf3_reserve(amf3_Writer *w, size_t size) {
+	char *buf;
+	return reserve(w, size, &buf) ? 0 : buf;
+}
+
+int amf3_writeData(amf3_Writer *w, const char *data, size_t size) {
+	char *buf;
+	int res;
+	if (w->sinkf && size >= w->size) { /* Pass large block directly to the sink */
+		if ((res = amf3_flush(w))) return res;
+		if (w->sinkf(w->sinkud, data, size)) return AMF3_ESINK;
+		w->total += size;
+		return AMF3_OK;
+	}
+	if ((res = reserve(w, size, &buf))) return res;
+	memcpy(buf, data, size);
+	return AMF3_OK;
+}
+
+static int writeEndianData(amf3_Writer *w, const char *data, size_t size) {
+	size_t i = 1;
+	char *buf;
+	int res = reserve(w, size, &buf);
+	if (res) return res;
+	if (!*(char *)&i) memcpy(buf, data, size); /* Big-endian */
+	else for (i = 0; i < size; ++i) buf[size - i - 1] = data[i]; /* Little-endian */
+	return AMF3_OK;
+}
+
+int amf3_writeByte(amf3_Writer *w, int val) {
+	char *buf;
+	int res;
+	if (w->pos < w->size) { /* Fast path */
+		w->buf[w->pos++] = val;
+		return AMF3_OK;
+	}
+	if ((res = reserve(w, 1, &buf))) return res;
+	*buf = val;
+	return AMF3_OK;
+}
+
+int amf3_writeU29(amf3_Writer *w, int val) {
+	char *buf;
+	int len, res;
+	val &= 0x1fffffff;
+	len = val <= 0x7f ? 1 : val <= 0x3fff ? 2 : val <= 0x1fffff ? 3 : 4;
+	if ((res = reserve(w, len, &buf))) return res;
+	switch (len) {
+		case 1:
+			buf[0] = val;
+			break;
+		case 2:
+			buf[0] = (val >> 7) | 0x80;
+			buf[1] = val & 0x7f;
+			break;
+		case 3:
+			buf[0] = (val >> 14) | 0x80;
+			buf[1] = (val >> 7) | 0x80;
+			buf[2] = val & 0x7f;
+			break;
+		default:
+			buf[0] = (val >> 22) | 0x80;
+			buf[1] = (val >> 15) | 0x80;
+			buf[2] = (val >> 8) | 0x80;
+			buf[3] = val;
+			break;
+	}
+	return AMF3_OK;
+}
+
+int amf3_writeU32(amf3_Writer *w, uint32_t val) {
+	return writeEndianData(w, (char *)&val, 4);
+}
+
+int amf3_writeFloat(amf3_Writer *w, float val) {
+	return writeEndianData(w, (char *)&val, 4);
+}
+
+int amf3_writeDouble(amf3_Writer *w, double val) {
+	return writeEndianData(w, (char *)&val, 8);
+}
+
+static int writeHeader(amf3_Writer *w, int type, int val) {
+	int res = amf3_writeByte(w, type);
+	return res ? res : amf3_writeU29(w, val);
+}
+
+static int writeInline(amf3_Writer *w, int type, const char *data, size_t size) {
+	int res;
+	if (size > AMF3_INT_MAX) return AMF3_ERANGE;
+	if ((res = writeHeader(w, type, (size << 1) | 1))) return res;
+	return amf3_writeData(w, data, size);
+}
+
+int amf3_writeUndefined(amf3_Writer *w) {
+	return amf3_writeByte(w, AMF3_UNDEFINED);
+}
+
+int amf3_writeNull(amf3_Writer *w) {
+	return amf3_writeByte(w, AMF3_NULL);
+}
+
+int amf3_writeBoolean(amf3_Writer *w, int val) {
+	return amf3_writeByte(w, val ? AMF3_TRUE : AMF3_FALSE);
+}
+
+int amf3_writeInteger(amf3_Writer *w, int64_t val) {
+	if (val < AMF3_INT_MIN || val > AMF3_INT_MAX) return amf3_writeNumber(w, val);
+	return writeHeader(w, AMF3_INTEGER, val);
+}
+
+int amf3_writeNumber(amf3_Writer *w, double val) {
+	int res = amf3_writeByte(w, AMF3_DOUBLE);
+	return res ? res : amf3_writeDouble(w, val);
+}
+
+int amf3_writeString(amf3_Writer *w, const char *str, size_t len) {
+	return writeInline(w, AMF3_STRING, str, len);
+}
+
+int amf3_writeByteArray(amf3_Writer *w, const char *data, size_t size) {
+	return writeInline(w, AMF3_BYTEARRAY, data, size);
+}
+
+int amf3_writeRef(amf3_Writer *w, int type, int ref) {
+	if (ref < 0 || ref > AMF3_INT_MAX) return AMF3_ERANGE;
+	return writeHeader(w, type, ref << 1);
+}
+
+int amf3_writeArray(amf3_Writer *w, int len) {
+	int res;
+	if (len < 0 || len > AMF3_INT_MAX) return AMF3_ERANGE;
+	if ((res = writeHeader(w, AMF3_ARRAY, (len << 1) | 1))) return res;
+	return amf3_writeByte(w, 0x01); /* Empty associative part */
+}
+
+int amf3_writeObject(amf3_Writer *w) {
+	int res = amf3_writeByte(w, AMF3_OBJECT);
+	if (res) return res;
+	if (w->traits) return amf3_writeByte(w, 0x01); /* Traits have been written earlier */
+	if ((res = amf3_writeByte(w, 0x0b))) return res; /* Traits: no static members, externalizable=0, dynamic=1 */
+	if ((res = amf3_writeByte(w, 0x01))) return res; /* Empty class name */
+	w->traits = 1;
+	return AMF3_OK;
+}
+
+int amf3_writeKey(amf3_Writer *w, const char *str, size_t len) {
+	int res;
+	if (len > AMF3_INT_MAX) return AMF3_ERANGE;
+	if ((res = amf3_writeU29(w, (len << 1) | 1))) return res;
+	return amf3_writeData(w, str, len);
+}
+
+int amf3_writeObjectEnd(amf3_Writer *w) {
+	return amf3_writeByte(w, 0x01); /* Empty key */
+}
+
+int amf3_writeDictionary(amf3_Writer *w, int len) {
+	int res;
+	if (len < 0 || len > AMF3_INT_MAX) return AMF3_ERANGE;
+	if ((res = writeHeader(w, AMF3_DICTIONARY, (len << 1) | 1))) return res;
+	return amf3_writeByte(w, 0x00); /* weak-keys=0 */
+}
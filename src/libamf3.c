@@ -0,0 +1,133 @@
+/*
+** Copyright (C) 2012-2020 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "libamf3.h"
+
+#define DEFCHUNK 4096
+
+typedef union {
+	void *p;
+	double d;
+	int64_t i;
+} Align;
+
+struct amf3_Chunk {
+	amf3_Chunk *next;
+	size_t size;
+	Align data[1];
+};
+
+#define HEADER offsetof(amf3_Chunk, data)
+#define ALIGN(n) (((n) + sizeof(Align) - 1) & ~(sizeof(Align) - 1))
+
+void *amf3_defaultAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	if (nsize) return realloc(ptr, nsize);
+	free(ptr);
+	return 0;
+}
+
+void amf3_initArena(amf3_Arena *arena, amf3_Alloc allocf, void *ud, size_t chunk) {
+	arena->allocf = allocf ? allocf : amf3_defaultAlloc;
+	arena->ud = ud;
+	arena->head = 0;
+	arena->chunk = ALIGN(chunk ? chunk : DEFCHUNK);
+	arena->pos = 0;
+	arena->last = 0;
+}
+
+static void freeChunk(amf3_Arena *arena, amf3_Chunk *chunk) {
+	arena->allocf(arena->ud, chunk, HEADER + chunk->size, 0);
+}
+
+void amf3_resetArena(amf3_Arena *arena) { /* Keep one regular chunk for reuse */
+	amf3_Chunk *chunk = arena->head, *keep = 0, *next;
+	for (; chunk; chunk = next) {
+		next = chunk->next;
+		if (!keep && chunk->size == arena->chunk) keep = chunk;
+		else freeChunk(arena, chunk);
+	}
+	if (keep) keep->next = 0;
+	arena->head = keep;
+	arena->pos = 0;
+	arena->last = 0;
+}
+
+void amf3_freeArena(amf3_Arena *arena) {
+	amf3_Chunk *chunk = arena->head, *next;
+	for (; chunk; chunk = next) {
+		next = chunk->next;
+		freeChunk(arena, chunk);
+	}
+	arena->head = 0;
+	arena->pos = 0;
+	arena->last = 0;
+}
+
+static void *newBlock(amf3_Arena *arena, size_t size) {
+	amf3_Chunk *chunk = arena->head;
+	size = ALIGN(size);
+	if (chunk && arena->pos + size <= chunk->size) { /* Enough space in the current chunk */
+		arena->last = (char *)chunk->data + arena->pos;
+		arena->pos += size;
+		return arena->last;
+	}
+	if (size > arena->chunk) { /* Dedicated chunk behind the current one */
+		if (!(chunk = arena->allocf(arena->ud, 0, 0, HEADER + size))) return 0;
+		chunk->size = size;
+		if (arena->head) {
+			chunk->next = arena->head->next;
+			arena->head->next = chunk;
+		} else {
+			chunk->next = 0;
+			arena->head = chunk;
+			arena->pos = size;
+			arena->last = 0;
+		}
+		return chunk->data;
+	}
+	if (!(chunk = arena->allocf(arena->ud, 0, 0, HEADER + arena->chunk))) return 0;
+	chunk->size = arena->chunk;
+	chunk->next = arena->head;
+	arena->head = chunk;
+	arena->pos = size;
+	return arena->last = chunk->data;
+}
+
+void *amf3_arenaAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	amf3_Arena *arena = ud;
+	char *buf;
+	if (ptr && ptr == arena->last) { /* Most recent block is resized in place */
+		size_t pos = (char *)ptr - (char *)arena->head->data;
+		if (pos + nsize <= arena->head->size) {
+			arena->pos = pos + ALIGN(nsize);
+			if (nsize) return ptr;
+			arena->last = 0;
+			return 0;
+		}
+	}
+	if (!nsize) return 0; /* Other blocks are released along with the arena */
+	if (!(buf = newBlock(arena, nsize))) return 0;
+	if (ptr) memcpy(buf, ptr, osize < nsize ? osize : nsize);
+	return buf;
+}
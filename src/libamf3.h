@@ -0,0 +1,235 @@
+/*
+** Copyright (C) 2012-2020 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AMF3_UNDEFINED     0x00
+#define AMF3_NULL          0x01
+#define AMF3_FALSE         0x02
+#define AMF3_TRUE          0x03
+#define AMF3_INTEGER       0x04
+#define AMF3_DOUBLE        0x05
+#define AMF3_STRING        0x06
+#define AMF3_XMLDOC        0x07
+#define AMF3_DATE          0x08
+#define AMF3_ARRAY         0x09
+#define AMF3_OBJECT        0x0a
+#define AMF3_XML           0x0b
+#define AMF3_BYTEARRAY     0x0c
+#define AMF3_VECTOR_INT    0x0d
+#define AMF3_VECTOR_UINT   0x0e
+#define AMF3_VECTOR_DOUBLE 0x0f
+#define AMF3_VECTOR_OBJECT 0x10
+#define AMF3_DICTIONARY    0x11
+
+#define AMF3_INT_MIN -268435456
+#define AMF3_INT_MAX 268435455
+#define AMF3_U29_MAX (AMF3_INT_MAX - AMF3_INT_MIN)
+
+/* Traits flags */
+#define AMF3_TRAITS_EXTERNALIZABLE 0x01
+#define AMF3_TRAITS_DYNAMIC        0x02
+
+/* Status codes */
+#define AMF3_OK     0
+#define AMF3_EMEM   1 /* Memory allocation failed */
+#define AMF3_ESINK  2 /* Sink failed */
+#define AMF3_EDATA  3 /* Insufficient data */
+#define AMF3_EREF   4 /* Invalid reference */
+#define AMF3_ETYPE  5 /* Invalid value type */
+#define AMF3_ERANGE 6 /* Value out of range */
+#define AMF3_ELIMIT 7 /* Reader limit exceeded */
+
+/* Reader events */
+#define AMF3_EVENT_VALUE 1 /* Primitive value, blob or reference to a complex value */
+#define AMF3_EVENT_BEGIN 2 /* Start of a new container */
+#define AMF3_EVENT_END   3 /* End of a container */
+
+#if defined(_WIN32) && defined(AMF3_SHARED)
+#define AMF3_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define AMF3_API __attribute__((visibility("default")))
+#else
+#define AMF3_API
+#endif
+
+/* Memory allocation function ('lua_Alloc' compatible) */
+typedef void *(*amf3_Alloc)(void *ud, void *ptr, size_t osize, size_t nsize);
+
+/* Output function that consumes 'size' bytes of 'data'; returns non-zero on failure */
+typedef int (*amf3_Sink)(void *ud, const char *data, size_t size);
+
+/*
+** Arena allocator
+** ---------------
+** Hands out memory from large chunks obtained from a parent allocator. Freeing or shrinking a block
+** is a no-op unless it is the most recent one, in which case it is done in place. All memory is
+** released at once by 'amf3_resetArena' or 'amf3_freeArena'.
+*/
+
+typedef struct amf3_Chunk amf3_Chunk;
+
+typedef struct {
+	amf3_Alloc allocf;
+	void *ud;
+	amf3_Chunk *head;
+	size_t chunk; /* Default chunk size */
+	size_t pos; /* Used space in the current chunk */
+	void *last; /* Most recent block */
+} amf3_Arena;
+
+AMF3_API void *amf3_defaultAlloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+AMF3_API void amf3_initArena(amf3_Arena *arena, amf3_Alloc allocf, void *ud, size_t chunk);
+AMF3_API void amf3_resetArena(amf3_Arena *arena);
+AMF3_API void amf3_freeArena(amf3_Arena *arena);
+AMF3_API void *amf3_arenaAlloc(void *ud, void *ptr, size_t osize, size_t nsize); /* 'ud' is an arena */
+
+/*
+** Streaming writer
+** ----------------
+** Appends AMF3 data to a growing buffer. If a sink is set, buffered data is flushed to it whenever
+** the buffer is full, and large blocks of data are passed to it directly without being copied.
+** Strings and complex values are always written inline. References can be written explicitly with
+** 'amf3_writeRef'.
+*/
+
+typedef struct {
+	char *buf;
+	size_t pos, size; /* Buffered data and buffer capacity */
+	size_t total; /* Data passed to the sink so far */
+	amf3_Alloc allocf;
+	void *allocud;
+	amf3_Sink sinkf;
+	void *sinkud;
+	int traits; /* Anonymous dynamic traits have been written */
+} amf3_Writer;
+
+AMF3_API void amf3_initWriter(amf3_Writer *w, amf3_Alloc allocf, void *ud);
+AMF3_API int amf3_setSink(amf3_Writer *w, amf3_Sink sinkf, void *ud, size_t size);
+AMF3_API int amf3_flush(amf3_Writer *w);
+AMF3_API void amf3_freeWriter(amf3_Writer *w);
+
+AMF3_API char *amf3_reserve(amf3_Writer *w, size_t size);
+AMF3_API int amf3_writeData(amf3_Writer *w, const char *data, size_t size);
+AMF3_API int amf3_writeByte(amf3_Writer *w, int val);
+AMF3_API int amf3_writeU29(amf3_Writer *w, int val);
+AMF3_API int amf3_writeU32(amf3_Writer *w, uint32_t val);
+AMF3_API int amf3_writeFloat(amf3_Writer *w, float val);
+AMF3_API int amf3_writeDouble(amf3_Writer *w, double val);
+
+AMF3_API int amf3_writeUndefined(amf3_Writer *w);
+AMF3_API int amf3_writeNull(amf3_Writer *w);
+AMF3_API int amf3_writeBoolean(amf3_Writer *w, int val);
+AMF3_API int amf3_writeInteger(amf3_Writer *w, int64_t val); /* Written as a double if out of U29 range */
+AMF3_API int amf3_writeNumber(amf3_Writer *w, double val);
+AMF3_API int amf3_writeString(amf3_Writer *w, const char *str, size_t len);
+AMF3_API int amf3_writeByteArray(amf3_Writer *w, const char *data, size_t size);
+AMF3_API int amf3_writeRef(amf3_Writer *w, int type, int ref);
+AMF3_API int amf3_writeArray(amf3_Writer *w, int len); /* Followed by 'len' values */
+AMF3_API int amf3_writeObject(amf3_Writer *w); /* Followed by key/value pairs and 'amf3_writeObjectEnd' */
+AMF3_API int amf3_writeKey(amf3_Writer *w, const char *str, size_t len);
+AMF3_API int amf3_writeObjectEnd(amf3_Writer *w);
+AMF3_API int amf3_writeDictionary(amf3_Writer *w, int len); /* Followed by 'len' key/value pairs */
+
+/*
+** Pull reader
+** -----------
+** Produces a stream of events for the values found in a buffer. A container is reported as BEGIN
+** followed by events for its items and a matching END. String references are resolved by the reader.
+** References to complex values are reported with their object reference index in 'ref'.
+** Optional limits can be set after 'amf3_initReader' to reject hostile input early.
+*/
+
+typedef struct {
+	int event; /* AMF3_EVENT_* */
+	int type; /* Value type (AMF3_*) */
+	int ref; /* Object reference index or -1 for an inline value */
+	int len; /* Number of items in an array/vector/dictionary or static members in an object */
+	int traits; /* Object traits flags */
+	const char *data; /* String/XML/ByteArray data, class name of an object, type name of a vector */
+	size_t size;
+	int64_t ival; /* Integer value (AMF3_INTEGER) */
+	double num; /* Numeric value (AMF3_DOUBLE, AMF3_DATE) */
+	int parent; /* Type of the enclosing container or 0 at the top level */
+	int index; /* Item index in the enclosing array/vector/dictionary */
+	const char *key; /* Member name in an object or in an associative part of an array */
+	size_t ksize;
+} amf3_Event;
+
+typedef struct {
+	size_t pos, len;
+} amf3_Span;
+
+typedef struct {
+	int pfx; /* Traits info as encoded */
+	int names; /* Index of the class name in 'names' followed by static member names */
+} amf3_Traits;
+
+typedef struct {
+	int type, len, count; /* Container type, reported length and number of items to read */
+	int index, member, phase, traits;
+	const char *data; /* Class name or vector type name */
+	size_t size;
+	int parent, pindex; /* Position in the enclosing container */
+	const char *key; /* Member name in the enclosing container */
+	size_t ksize;
+} amf3_Frame;
+
+typedef struct {
+	const char *buf;
+	size_t pos, size;
+	amf3_Alloc allocf;
+	void *allocud;
+	amf3_Span *strs, *names;
+	amf3_Traits *traits;
+	amf3_Frame *frames;
+	int nstrs, nnames, ntraits, nframes, nobjs;
+	int cstrs, cnames, ctraits, cframes;
+	int maxdepth, maxlen; /* Limits on nesting depth and container length (0 means no limit) */
+	size_t maxnodes, maxbytes; /* Limits on the number of values and total string/blob size (0 means no limit) */
+	size_t nodes, bytes; /* Values and string/blob data read so far */
+	char msg[80]; /* Error message */
+} amf3_Reader;
+
+AMF3_API void amf3_initReader(amf3_Reader *r, const char *buf, size_t size, amf3_Alloc allocf, void *ud);
+AMF3_API void amf3_freeReader(amf3_Reader *r);
+AMF3_API int amf3_next(amf3_Reader *r, amf3_Event *ev);
+AMF3_API int amf3_depth(const amf3_Reader *r);
+
+AMF3_API int amf3_readByte(amf3_Reader *r, int *val);
+AMF3_API int amf3_readU29(amf3_Reader *r, int *val);
+AMF3_API int amf3_readU32(amf3_Reader *r, uint32_t *val);
+AMF3_API int amf3_readFloat(amf3_Reader *r, float *val);
+AMF3_API int amf3_readDouble(amf3_Reader *r, double *val);
+AMF3_API int amf3_readData(amf3_Reader *r, size_t size, const char **data);
+
+#ifdef __cplusplus
+}
+#endif
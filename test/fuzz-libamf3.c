@@ -0,0 +1,290 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libamf3.h"
+
+#ifdef AMF3_LUA
+#include "amf3.h"
+#endif
+
+typedef struct {
+	double time; /* Seconds per pass */
+	size_t allocs; /* Allocations per pass */
+} Stats;
+
+static size_t allocs;
+
+static void *countAlloc(void *ud, void *ptr, size_t osize, size_t nsize) { /* Also works as 'lua_Alloc' */
+	if (nsize && (!ptr || nsize > osize)) ++allocs; /* Lua passes a type tag in 'osize' for new blocks */
+	return amf3_defaultAlloc(ud, ptr, osize, nsize);
+}
+
+#ifdef AMF3_LUA
+
+/*
+** Lua flavor
+** ----------
+** Built as 'fuzz-amf3', this program decodes inputs with the Lua module itself, so that the time
+** and allocations spent on building Lua values are measured along with the reader.
+*/
+
+static lua_State *L;
+
+static void openState(void) { /* Leaves the module at index 1 and decoding limits at index 2 */
+	if (!(L = lua_newstate(countAlloc, 0)) && !(L = luaL_newstate())) { /* Allocations are not counted if LuaJIT rejects the allocator */
+		fprintf(stderr, "cannot create Lua state\n");
+		exit(2);
+	}
+	lua_pushcfunction(L, luaopen_amf3);
+	lua_call(L, 0, 1);
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, 100);
+	lua_setfield(L, 2, "depth");
+	lua_pushinteger(L, 1 << 20);
+	lua_setfield(L, 2, "length");
+	lua_pushinteger(L, 1 << 20);
+	lua_setfield(L, 2, "values");
+	lua_pushinteger(L, 1 << 24);
+	lua_setfield(L, 2, "bytes");
+}
+
+static lua_Integer call(const char *name, int nargs) { /* Calls a module function; returns the next position or 0 on error */
+	lua_Integer res;
+	lua_getfield(L, 1, name);
+	lua_insert(L, -nargs - 1);
+	if (lua_pcall(L, nargs, LUA_MULTRET, 0)) return 0;
+	res = lua_tointeger(L, -1);
+	lua_settop(L, 3);
+	return res;
+}
+
+static void collect(void) {
+	if (!L) openState();
+	lua_gc(L, LUA_GCCOLLECT, 0);
+}
+
+static void decode(const char *buf, size_t size) {
+	lua_Integer pos = 1;
+	if (!L) openState();
+	lua_pushlstring(L, buf, size);
+	do { /* Consecutive root values until the end of data or an error */
+		lua_pushvalue(L, 3);
+		lua_pushinteger(L, pos);
+		lua_pushnil(L);
+		lua_pushvalue(L, 2);
+	} while ((pos = call("decode", 4)) && pos <= (lua_Integer)size);
+	pos = 1;
+	do { /* Strings with U29 lengths until the end of data or an error */
+		lua_pushliteral(L, "s");
+		lua_pushvalue(L, 3);
+		lua_pushinteger(L, pos);
+	} while ((pos = call("unpack", 3)) && pos <= (lua_Integer)size);
+	lua_settop(L, 2);
+}
+
+#else
+
+static void collect(void) {
+}
+
+static void decode(const char *buf, size_t size) {
+	amf3_Reader r;
+	amf3_Event ev;
+	const char *data;
+	int len;
+	amf3_initReader(&r, buf, size, countAlloc, 0); /* Same path as 'amf3.decode' with limits */
+	r.maxdepth = 100;
+	r.maxlen = 1 << 20;
+	r.maxnodes = 1 << 20;
+	r.maxbytes = 1 << 24;
+	while (!amf3_next(&r, &ev)); /* Consecutive root values until the end of data or an error */
+	amf3_freeReader(&r);
+	amf3_initReader(&r, buf, size, countAlloc, 0); /* Same path as 'amf3.unpack' with options 'u' and 's' */
+	while (!amf3_readU29(&r, &len) && !amf3_readData(&r, len, &data));
+	amf3_freeReader(&r);
+}
+
+#endif
+
+static Stats measure(const char *buf, size_t size) { /* Times a single pass and counts its allocations */
+	Stats s;
+	clock_t t;
+	collect(); /* Same starting point for every input */
+	allocs = 0;
+	t = clock();
+	decode(buf, size);
+	s.time = (double)(clock() - t) / CLOCKS_PER_SEC;
+	s.allocs = allocs;
+	return s;
+}
+
+#ifdef AMF3_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static double slowest;
+	Stats s = measure((const char *)data, size);
+	if (s.time > slowest) {
+		slowest = s.time;
+		fprintf(stderr, "slowest input: %lu bytes, %.0f us, %lu allocations\n", (unsigned long)size, s.time * 1e6, (unsigned long)s.allocs);
+	}
+	return 0;
+}
+
+#else
+
+/*
+** Corpus replay
+** -------------
+** Usage: fuzz-libamf3 [-b baseline | -s baseline] [-t threshold] file...
+** Decodes each file once. With '-b' or '-s', each file is also decoded in batches lasting at least
+** MINTIME seconds. Batches of all files take turns for BATCHES rounds, so that a slow period of the
+** machine does not hit every batch of the same file. The fastest batch gives the throughput of a file.
+** With '-s', the throughput and the number of allocations of each file are saved to the baseline file.
+** With '-b', they are compared with the baseline file, which must exist. The check fails if throughput
+** drops, or the number of allocations grows, by more than 'threshold' percent (default is 20).
+*/
+
+#define BATCHES 5
+#define MINTIME 0.1
+
+typedef struct {
+	const char *name;
+	char *buf;
+	size_t size;
+	Stats s;
+} Input;
+
+typedef struct {
+	char name[256];
+	double rate; /* Bytes per second */
+	unsigned long allocs;
+} Entry;
+
+static double measureBatch(const char *buf, size_t size) { /* Returns seconds per pass */
+	clock_t t;
+	double d;
+	long n = 0;
+	collect();
+	t = clock();
+	do {
+		decode(buf, size);
+		d = (double)(clock() - t) / CLOCKS_PER_SEC;
+	} while (++n, d < MINTIME);
+	return d / n;
+}
+
+static const char *baseName(const char *path) {
+	const char *p = strrchr(path, '/');
+	return p ? p + 1 : path;
+}
+
+static char *readFile(const char *path, size_t *size) {
+	FILE *f = fopen(path, "rb");
+	char *buf = 0;
+	long len;
+	if (!f) return 0;
+	if (!fseek(f, 0, SEEK_END) && (len = ftell(f)) >= 0 && !fseek(f, 0, SEEK_SET) && (buf = malloc(len + 1))) {
+		*size = fread(buf, 1, len, f);
+	}
+	fclose(f);
+	return buf;
+}
+
+static int loadBaseline(const char *path, Entry **base, int *nbase) {
+	FILE *f = fopen(path, "r");
+	Entry e;
+	if (!f) return 0;
+	while (fscanf(f, "%255s %lf %lu", e.name, &e.rate, &e.allocs) == 3) {
+		Entry *p = realloc(*base, (*nbase + 1) * sizeof e);
+		if (!p) break;
+		*base = p;
+		(*base)[(*nbase)++] = e;
+	}
+	fclose(f);
+	return 1;
+}
+
+static const Entry *findEntry(const Entry *base, int nbase, const char *name) {
+	int i;
+	for (i = 0; i < nbase; ++i) {
+		if (!strcmp(base[i].name, name)) return base + i;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *bpath = 0, *spath = 0;
+	double threshold = 20;
+	Entry *base = 0;
+	Input *in;
+	int i, r, nin = 0, nbase = 0, fails = 0;
+	FILE *out = 0;
+	for (i = 1; i < argc && argv[i][0] == '-'; i += 2) {
+		if (i + 1 == argc) break;
+		if (!strcmp(argv[i], "-b")) bpath = argv[i + 1];
+		else if (!strcmp(argv[i], "-s")) spath = argv[i + 1];
+		else if (!strcmp(argv[i], "-t")) threshold = atof(argv[i + 1]);
+		else break;
+	}
+	if (i == argc || (bpath && spath)) {
+		fprintf(stderr, "usage: %s [-b baseline | -s baseline] [-t threshold] file...\n", argv[0]);
+		return 2;
+	}
+	if (bpath && (!loadBaseline(bpath, &base, &nbase) || !nbase)) { /* A fresh baseline would always pass */
+		fprintf(stderr, "cannot read baseline '%s' (save one with '-s')\n", bpath);
+		return 2;
+	}
+	if (spath && !(out = fopen(spath, "w"))) {
+		fprintf(stderr, "cannot create '%s'\n", spath);
+		return 2;
+	}
+	if (!(in = calloc((unsigned)(argc - i), sizeof *in))) {
+		fprintf(stderr, "cannot allocate memory\n");
+		return 2;
+	}
+	for (; i < argc; ++i, ++nin) {
+		Input *p = in + nin;
+		p->name = baseName(argv[i]);
+		if (!(p->buf = readFile(argv[i], &p->size))) {
+			fprintf(stderr, "cannot read '%s'\n", argv[i]);
+			++fails;
+			continue;
+		}
+		p->s = measure(p->buf, p->size);
+	}
+	for (r = 0; (bpath || spath) && r < BATCHES; ++r) {
+		for (i = 0; i < nin; ++i) {
+			double t;
+			if (in[i].buf && (t = measureBatch(in[i].buf, in[i].size)) < in[i].s.time) in[i].s.time = t;
+		}
+	}
+	for (i = 0; (bpath || spath) && i < nin; ++i) {
+		const Input *p = in + i;
+		const Entry *e;
+		double rate;
+		if (!p->buf) continue;
+		rate = (p->size ? p->size : 1) / (p->s.time > 0 ? p->s.time : 1e-9);
+		printf("%-32s %8lu bytes %10.1f MB/s %6lu allocations", p->name, (unsigned long)p->size, rate / 1e6, (unsigned long)p->s.allocs);
+		if (out) fprintf(out, "%s %.0f %lu\n", p->name, rate, (unsigned long)p->s.allocs);
+		else if (!(e = findEntry(base, nbase, p->name))) printf(" (new)");
+		else if (rate < e->rate * (1 - threshold / 100) || p->s.allocs > e->allocs * (1 + threshold / 100)) {
+			printf(" REGRESSION (baseline %.1f MB/s, %lu allocations)", e->rate / 1e6, e->allocs);
+			++fails;
+		}
+		printf("\n");
+	}
+	for (i = 0; i < nin; ++i) free(in[i].buf);
+	free(in);
+	if (out) {
+		fclose(out);
+		printf("baseline saved to '%s'\n", spath);
+	}
+	free(base);
+	return fails ? 1 : 0;
+}
+
+#endif
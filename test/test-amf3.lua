@@ -244,6 +244,489 @@ assert(not pcall(amf3.encode, setmetatable({}, {__toAMF3 = function (t) t() end}
 assert(not pcall(amf3.encode, {a = print})) -- Invalid value
 assert(not pcall(amf3.encode, {[print] = 1})) -- Invalid key
 
+-- ByteArray
+local bytes = {__bytes = string.char(0x11, 0x22, 0x33)}
+assert(amf3.encode(bytes) == string.char(0x0c, 0x07, 0x11, 0x22, 0x33))
+assert(amf3.encode({__array = true, 'abc', {__bytes = 'abc'}, bytes, bytes}) == string.char(
+	0x09, 0x09, 0x01, -- Array (length 4)
+		0x06, 0x07, 0x61, 0x62, 0x63, -- String ('abc')
+		0x0c, 0x07, 0x61, 0x62, 0x63, -- ByteArray ('abc'), not a string reference
+		0x0c, 0x07, 0x11, 0x22, 0x33, -- ByteArray (0x11 0x22 0x33)
+		0x0c, 0x04 -- ByteArray (reference 2)
+))
+assert(compare(amf3.decode(amf3.encode({__array = true, bytes, bytes})), {__array = 2, bytes.__bytes, bytes.__bytes}))
+assert(amf3.decode(amf3.encode({__bytes = ''})) == '')
+local blob = {__bytes = ('x'):rep(100000)}
+assert(amf3.decode(amf3.encode(blob)) == blob.__bytes)
+assert(amf3.size({__array = true, blob, blob}) == #amf3.encode({__array = true, blob, blob}))
+assert(compare(amf3.decode(amf3.encode({__bytes = 1})), {__bytes = 1})) -- Not a blob
+assert(not pcall(amf3.encode, setmetatable({__bytes = 'abc'}, {})))
+
+------------------------
+-- Size and hash test --
+------------------------
+
+local fnv = _VERSION ~= 'Lua 5.1' and _VERSION ~= 'Lua 5.2' and load[[
+	local str = ...
+	local h = -3750763034362895579
+	for i = 1, #str do
+		h = (h ~ str:byte(i)) * 0x100000001b3
+	end
+	return ('%016x'):format(h)
+]]
+for i = 1, 1000 do
+	local obj = spawn()
+	local str = amf3.encode(obj)
+	assert(amf3.size(obj) == #str)
+	assert(amf3.hash(obj) == amf3.hash(obj))
+	assert(#amf3.hash(obj) == 16)
+	if fnv then
+		assert(amf3.hash(obj) == fnv(str))
+	end
+end
+local big = {__array = true, ('x'):rep(1000), {a = ('y'):rep(1000)}}
+assert(amf3.size(big) == #amf3.encode(big))
+assert(amf3.hash(big) ~= amf3.hash({__array = true, ('x'):rep(1000), {a = ('y'):rep(999)}}))
+assert(amf3.hash('') ~= amf3.hash(amf3.null))
+assert(not pcall(amf3.size, print))
+assert(not pcall(amf3.hash, {print}))
+
+----------------------------
+-- Canonical encoding test --
+----------------------------
+
+local function record(d)
+	local t = {}
+	for i = 1, math.random(0, 8) do
+		local k = vals[math.random(3, 6)]() -- Boolean, integer, double or string key
+		t[k] = d < 3 and math.random() < 0.3 and record(d + 1) or vals[math.random(2, #vals)]()
+	end
+	return t
+end
+local function shuffle(t)
+	if type(t) ~= 'table' then
+		return t
+	end
+	local ks, r = {}, {}
+	for k in pairs(t) do
+		table.insert(ks, math.random(#ks + 1), k)
+	end
+	for _, k in ipairs(ks) do
+		r[k] = shuffle(t[k])
+	end
+	return r
+end
+for i = 1, 1000 do
+	local obj = record(0)
+	local str = amf3.encode(obj, nil, true)
+	local obj_ = shuffle(obj)
+	assert(amf3.encode(obj_, nil, true) == str)
+	assert(compare(amf3.decode(str), amf3.decode(amf3.encode(obj_))))
+	assert(amf3.size(obj_, nil, true) == #str)
+	assert(amf3.hash(obj_, nil, true) == amf3.hash(obj, nil, true))
+	local job, done, str_ = amf3.encode_job(obj_, nil, true)
+	repeat
+		done, str_ = job:step(math.random(10))
+	until done
+	assert(str_ == str)
+end
+local str = amf3.encode({b = 1, a = {z = true, y = false}, [2] = 1, [1.5] = 1, [true] = 1, [{}] = 1}, nil, true)
+assert(str:find('a', 1, true) < str:find('b', 1, true))
+assert(str:find('y', 1, true) < str:find('z', 1, true))
+local t = {}
+for i = 1, 10 do
+	t[string.rep('k', 50) .. i] = i -- Keys are only referenced by the table
+end
+t[string.rep('k', 50) .. 0] = setmetatable({}, {__toAMF3 = function ()
+	for k in pairs(t) do
+		t[k] = nil
+	end
+	collectgarbage()
+	return 0
+end})
+t = amf3.decode(amf3.encode(t, nil, true)) -- Table drops keys that are yet to be encoded
+assert(t[string.rep('k', 50) .. 0] == 0 and t[string.rep('k', 50) .. 10] == nil)
+
+-----------------
+-- Freeze test --
+-----------------
+
+for i = 1, 1000 do
+	local obj = spawn()
+	local frozen = {}
+	for _, t in ipairs(refs) do
+		if math.random() < 0.3 then
+			table.insert(frozen, amf3.freeze(t))
+		end
+	end
+	local msg = setmetatable({__array = #refs + 2, obj, obj}, mt)
+	for i, t in ipairs(refs) do
+		msg[i + 2] = t
+	end
+	local str = amf3.encode(msg)
+	assert(compare(amf3.decode(str, nil, handler), msg))
+	for _, t in ipairs(frozen) do
+		amf3.thaw(t)
+	end
+end
+
+local cfg = {a = 'abc', b = {__array = true, 'abc', 'def'}, c = {x = 1}}
+local msg = {__array = true, 'abc', cfg, 'def', {x = 2, y = 'abc'}, cfg}
+local out = amf3.decode(amf3.encode(msg))
+assert(amf3.freeze(cfg) == cfg)
+assert(compare(out, amf3.decode(amf3.encode(msg))))
+out = amf3.decode(amf3.encode(msg))
+assert(out[2] == out[5]) -- Frozen table is still sent by reference
+cfg.a = 'xyz'
+assert(amf3.decode(amf3.encode(msg))[2].a == 'abc') -- Encoded data is cached
+amf3.freeze(cfg)
+assert(amf3.decode(amf3.encode(msg))[2].a == 'xyz')
+assert(amf3.thaw(cfg) == cfg)
+cfg.a = 'uvw'
+assert(amf3.decode(amf3.encode(msg))[2].a == 'uvw')
+local str = amf3.freeze(setmetatable({}, {__toAMF3 = function () return 'abc' end}))
+assert(compare(amf3.decode(amf3.encode({__array = true, str, 'abc', str})), {__array = 3, 'abc', 'abc', 'abc'}))
+local t = {}
+t.t = t
+assert(not pcall(amf3.freeze, t)) -- Recursion detected
+assert(not pcall(amf3.freeze, 'abc'))
+local t1, t2 = {}, {}
+for i = 1, 20 do
+	t1['k' .. i] = {i, x = i}
+	t2['k' .. 21 - i] = {21 - i, x = 21 - i}
+end
+amf3.freeze(t1)
+t1.k1.x = 0
+assert(amf3.decode(amf3.encode(t1, nil, true)).k1.x == 0) -- Data frozen in traversal order is not used
+t1.k1.x = 1
+amf3.freeze(t1, nil, true)
+amf3.freeze(t2, nil, true)
+t1.k1.x = 0
+assert(amf3.decode(amf3.encode(t1, nil, true)).k1.x == 1) -- Data frozen in canonical order is used
+assert(amf3.encode(t1, nil, true) == amf3.encode(t2, nil, true))
+assert(amf3.hash(t1, nil, true) == amf3.hash(t2, nil, true))
+
+cfg = amf3.freeze({a = 'abc', b = {__array = true, 1, 2, 3}})
+amf3.share('cfg', cfg)
+local proxy = amf3.shared('cfg')
+assert(proxy ~= cfg and next(proxy) == nil)
+assert(amf3.encode(proxy) == amf3.encode(cfg))
+assert(amf3.encode({__array = true, proxy, proxy}) == amf3.encode({__array = true, cfg, cfg}))
+amf3.thaw(cfg)
+cfg = nil
+collectgarbage()
+assert(compare(amf3.decode(amf3.encode(proxy)), {a = 'abc', b = {__array = 3, 1, 2, 3}})) -- Data outlives the original table
+amf3.share('cfg', amf3.freeze({x = 1}))
+assert(amf3.decode(amf3.encode(amf3.shared('cfg'))).x == 1)
+assert(amf3.decode(amf3.encode(proxy)).a == 'abc')
+amf3.share('cfg', nil)
+assert(amf3.shared('cfg') == nil)
+assert(amf3.shared('xyz') == nil)
+assert(not pcall(amf3.share, 'cfg', {})) -- Table is not frozen
+amf3.share('cfg', amf3.freeze({a = 'abc', b = {__array = true, 1, 2, 3}}))
+proxy = amf3.shared('cfg')
+assert(not pcall(amf3.freeze, proxy)) -- Shared data would be replaced by an empty table
+assert(not pcall(amf3.thaw, proxy))
+assert(amf3.encode(proxy) == amf3.encode(amf3.shared('cfg')))
+amf3.share('cfg', amf3.freeze({a = 1, b = 2}))
+assert(not pcall(amf3.encode, amf3.shared('cfg'), nil, true)) -- Shared data is not canonical
+amf3.share('cfg', amf3.freeze({a = 1, b = 2}, nil, true))
+assert(amf3.encode(amf3.shared('cfg'), nil, true) == amf3.encode({a = 1, b = 2}, nil, true))
+amf3.share('cfg', nil)
+
+-------------------------
+-- Columnar decode test --
+-------------------------
+
+for i = 1, 1000 do
+	refs = {}
+	local n = math.random(0, 20)
+	local rows = {__array = n}
+	for j = 1, n do
+		if j > 1 and math.random() < 0.2 then
+			rows[j] = rows[math.random(j - 1)] -- Reference to a row
+		else
+			local row = {}
+			for _, k in ipairs{'a', 'b', 'c'} do
+				if math.random() < 0.8 then
+					row[k] = any(3)
+				end
+			end
+			rows[j] = row
+		end
+	end
+	local str = amf3.encode(rows)
+	local cols = {}
+	for j, row in ipairs(amf3.decode(str, nil, handler)) do
+		for k, v in pairs(row) do
+			cols[k] = cols[k] or setmetatable({__array = n}, mt)
+			cols[k][j] = v
+		end
+	end
+	local cols_, pos = amf3.decode_columns(str, nil, handler)
+	assert(compare(cols_, setmetatable(cols, mt)))
+	assert(pos == #str + 1)
+end
+
+local nested = {x = 1}
+local str = amf3.encode({__array = true, {a = nested}, {a = nested}})
+local function wrap(t)
+	return t.x and {t} or t
+end
+local cols = amf3.decode_columns(str, nil, wrap)
+assert(compare(cols.a[1], {{x = 1}}) and compare(cols.a[2], {{x = 1}})) -- Handler is called for a repeated table
+assert(compare(cols.a[2], amf3.decode(str, nil, wrap)[2].a))
+
+local row = {a = 1}
+assert(not pcall(amf3.decode_columns, amf3.encode({a = 1}))) -- Array expected
+assert(not pcall(amf3.decode_columns, amf3.encode({__array = true, row, 1}))) -- Array of objects expected
+assert(not pcall(amf3.decode_columns, amf3.encode({__array = true, row, {__array = true}}))) -- Array of objects expected
+assert(not pcall(amf3.decode_columns, amf3.encode({__array = true, row, {b = row}}))) -- Reference to a row
+
+-----------------
+-- Limits test --
+-----------------
+
+local str = amf3.encode({__array = true, 'abc', {__array = true, 'abc'}})
+local limits = {depth = 2, length = 2, values = 4, bytes = 6}
+assert(amf3.decode(str, nil, nil, limits))
+for k, v in pairs(limits) do
+	local limits_ = copy(limits)
+	limits_[k] = v - 1
+	assert(not pcall(amf3.decode, str, nil, nil, limits_))
+	local job = amf3.decode_job(str, nil, nil, limits_)
+	assert(not pcall(job.step, job))
+end
+local job = amf3.decode_job(str, nil, nil, limits)
+assert(job:step())
+assert(amf3.decode_columns(amf3.encode({__array = true, {a = 1}, {a = 2}}), nil, nil, {values = 5}))
+assert(not pcall(amf3.decode_columns, amf3.encode({__array = true, {a = 1}, {a = 2}}), nil, nil, {values = 4}))
+assert(not pcall(amf3.decode, str, nil, nil, {depth = 0})) -- Invalid limit
+assert(not pcall(amf3.decode, str, nil, nil, {depth = 'abc'})) -- Invalid limit
+assert(not pcall(amf3.decode, str, nil, nil, 1)) -- Invalid limits
+
+--------------
+-- Job test --
+--------------
+
+for i = 1, 1000 do
+	local obj = spawn()
+	local str = amf3.encode(obj)
+	local job1, job2 = amf3.encode_job(obj), amf3.decode_job(str, nil, handler)
+	local done1, done2, str_, obj_, pos
+	repeat -- Interleave jobs
+		if not done1 then
+			done1, str_ = job1:step(math.random(10))
+		end
+		if not done2 then
+			done2, obj_, pos = job2:step(math.random(10))
+		end
+	until done1 and done2
+	assert(str_ == str)
+	assert(compare(obj, obj_))
+	assert(pos == #str + 1)
+	assert(not pcall(job1.step, job1)) -- Job is finished
+	assert(not pcall(job2.step, job2)) -- Job is finished
+end
+
+local job = amf3.encode_job({__array = true, 1, 2, {a = print}})
+assert(not pcall(job.step, job, -1)) -- Invalid budget
+assert(not job:step(2))
+local ok, err = pcall(job.step, job)
+assert(not ok and err:find('[3] => ["a"] => function unexpected', 1, true))
+assert(not pcall(job.step, job)) -- Job is finished
+job = amf3.decode_job(amf3.encode({1, 2, 3}):sub(1, -2))
+assert(not pcall(job.step, job)) -- Insufficient data
+assert(not pcall(job.step, job)) -- Job is finished
+job = amf3.decode_job(amf3.encode(1))
+assert(not pcall(job.step, job, 0)) -- Invalid budget
+assert(not pcall(job.step, job, -1))
+assert(not pcall(job.step, job, 0.5))
+assert(select('#', job:step(2^32)) == 3) -- No effective limit
+job = amf3.decode_job(amf3.encode(1))
+assert(select('#', job:step()) == 3)
+
+------------------
+-- Encoder test --
+------------------
+
+local enc, enc2, enc3 = amf3.encoder(), amf3.encoder(nil, true), amf3.encoder(nil, nil, 3)
+local keys = {'id', 'name', 'abc', 'def', 'time', 'x'}
+local function record(d)
+	local t = {}
+	for _, k in ipairs(keys) do
+		if math.random() < 0.7 then
+			t[k] = d < 2 and math.random() < 0.3 and record(d + 1) or any(3)
+		end
+	end
+	return t
+end
+for i = 1, 1000 do
+	local obj = math.random() < 0.5 and spawn() or {__array = true, record(0), keys[math.random(#keys)], record(0)}
+	assert(enc:encode(obj) == amf3.encode(obj))
+	assert(enc2:encode(obj) == amf3.encode(obj, nil, true))
+	assert(enc3:encode(obj) == amf3.encode(obj))
+end
+
+local msg = {__array = true, 'id', {id = 1, name = 'id'}, {id = 2}, 'name', amf3.freeze({name = 'x'}), {name = 3}}
+assert(enc:encode(msg) == amf3.encode(msg)) -- Keys are also values
+assert(enc:encode(msg) == amf3.encode(msg))
+local str = setmetatable({}, {__toAMF3 = function () return enc:encode({zz = 'z', name = 'x', id = 3}) end}) -- Nested message
+msg = {__array = true, {name = 1, id = 1}, str, {id = 2, name = 2, zz = 2}}
+assert(enc:encode(msg) == amf3.encode(msg)) -- Messages have different string tables
+assert(enc:encode(msg) == amf3.encode(msg))
+assert(not pcall(enc.encode, enc, {a = setmetatable({}, {__toAMF3 = function () enc:encode({}) error('abc') end})}))
+assert(enc:encode(msg) == amf3.encode(msg))
+assert(amf3.encoder('__toXYZ'):encode(setmetatable({}, {__toXYZ = function () return 'abc' end})) == amf3.encode('abc'))
+assert(not pcall(enc.encode, enc, print))
+assert(not pcall(enc.encode, enc))
+assert(not pcall(amf3.encoder, nil, nil, -1))
+
+----------------
+-- Delta test --
+----------------
+
+local keys = {'a', 'b', 'c', 'd', 1, 2, 3}
+local function value(d, gen)
+	if d < 3 and math.random() < 0.3 then
+		return gen(d + 1)
+	end
+	return vals[math.random(#vals)]()
+end
+local function array(d)
+	local t = {__array = true}
+	for i = 1, math.random(0, 5) do
+		t[i] = vals[math.random(2, #vals)]()
+	end
+	if math.random() < 0.3 then
+		t.x = vals[math.random(2, #vals)]() -- Not encoded
+	end
+	return t
+end
+local function record(d)
+	local t = {}
+	for i = 1, math.random(0, #keys) do
+		t[keys[math.random(#keys)]] = value(d, math.random() < 0.3 and array or record)
+	end
+	return math.random() < 0.2 and setmetatable(t, mt) or t -- Exported through a metamethod
+end
+local function mutate(t, d)
+	if t.__array then
+		local n = #t
+		if math.random() < 0.3 then
+			t[n + 1] = vals[math.random(2, #vals)]()
+		elseif n > 0 and math.random() < 0.3 then
+			t[n] = nil
+		elseif math.random() < 0.3 then
+			t[keys[math.random(#keys)]] = vals[math.random(2, #vals)]()
+		elseif n > 0 then
+			t[math.random(n)] = vals[math.random(2, #vals)]()
+		end
+		return
+	end
+	for i = 1, math.random(3) do
+		local k = keys[math.random(#keys)]
+		if type(t[k]) == 'table' and math.random() < 0.5 then
+			mutate(t[k], d + 1)
+		else
+			t[k] = value(d, math.random() < 0.3 and array or record)
+		end
+	end
+end
+
+local delta = amf3.delta()
+local state, out = record(0)
+for i = 1, 1000 do
+	local str = delta:encode(state)
+	local pos
+	out, pos = amf3.apply_delta(out, str)
+	assert(compare(out, amf3.decode(amf3.encode(state))))
+	assert(pos == #str + 1)
+	mutate(state, 0)
+end
+
+local big = {}
+for i = 1, 100 do
+	big['k' .. i] = {x = i, y = {__array = true, i, i}}
+end
+delta:reset()
+local full = delta:encode(big)
+big.k50.x = -1
+assert(#delta:encode(big) < #full / 10)
+assert(#delta:encode(big) == 4) -- No changes
+big.k50.x = 50
+delta:reset()
+assert(delta:encode(big) == full)
+
+assert(not pcall(delta.encode, delta, {print})) -- Invalid value
+assert(delta:encode(big) == full) -- Snapshot is reset on error
+assert(not pcall(delta.encode, delta, {a = setmetatable({}, {__toAMF3 = function () error('abc') end})}))
+assert(delta:encode(big) == full) -- Snapshot is reset on error in a metamethod
+
+local obj = setmetatable({v = 1}, mt)
+local root = setmetatable({obj = obj}, mt)
+delta:reset()
+out = amf3.apply_delta(nil, delta:encode(root))
+obj.v = 2 -- Changed in place
+local str = delta:encode(root)
+assert(amf3.decode(str).r == nil) -- Transformed values are compared structurally
+out = amf3.apply_delta(out, str)
+assert(compare(out, {obj = {v = 2}}))
+
+state = {t = {__array = 2, 1, 2, 3, x = 1}, u = {x = 1, y = 2}}
+delta:reset()
+out = amf3.apply_delta(nil, delta:encode(state))
+assert(compare(out, amf3.decode(amf3.encode(state)))) -- Only items of arrays are sent
+state.t[1], state.t[3], state.t.x = 9, 7, 2
+state.u = {__array = true, 5, x = 1}
+str = delta:encode(state)
+out = amf3.apply_delta(out, str)
+assert(compare(out, amf3.decode(amf3.encode(state))))
+local p, patches = amf3.decode(str).p, {}
+for i = 1, #p, 2 do
+	patches[p[i]] = p[i + 1]
+end
+assert(compare(patches.t, {s = {__array = 2, 1, 9}})) -- Changes to other keys are not sent
+assert(compare(patches.u.s, {__array = 4, '__array', 1, 1, 5}) and patches.u.d.__array == 2) -- Fields become other keys
+local cyclic = {}
+cyclic.t = cyclic
+assert(not pcall(delta.encode, delta, cyclic)) -- Cycles are not supported
+
+local none = setmetatable({}, {__toAMF3 = function () end})
+state = {a = 'b', b = 2}
+delta:reset()
+out = amf3.apply_delta(nil, delta:encode(state))
+state = {a = none, b = 3, c = 'x', d = {none, 1, none}}
+out = amf3.apply_delta(out, delta:encode(state)) -- Values transformed into nil are removed
+assert(compare(out, {b = 3, c = 'x', d = {[2] = 1}}))
+state.b = none
+out = amf3.apply_delta(out, delta:encode(state))
+assert(compare(out, {c = 'x', d = {[2] = 1}}))
+
+state = {a = {x = 1}, b = {__bytes = 'abc'}}
+delta:reset()
+out = amf3.apply_delta(nil, delta:encode(state))
+state.b.__bytes = 'xyz' -- Changed in place
+out = amf3.apply_delta(out, delta:encode(state)) -- Blob is replaced rather than patched
+assert(compare(out, {a = {x = 1}, b = 'xyz'}))
+assert(#delta:encode(state) == 4) -- No changes
+state.b = {__bytes = 'xyz'}
+assert(#delta:encode(state) == 4) -- Blobs are compared by contents
+
+local key = {}
+state = {[key] = 1, a = 1}
+delta:reset()
+out = amf3.apply_delta(nil, delta:encode(state))
+state[key] = nil
+out = amf3.apply_delta(out, delta:encode(state)) -- Receiver cannot look up a table key
+assert(compare(out, {a = 1}))
+state[key] = 2
+out = amf3.apply_delta(out, delta:encode(state))
+assert(compare(out, {[{}] = 2, a = 1}))
+assert(not pcall(amf3.apply_delta, {}, amf3.encode(1))) -- Invalid delta
+assert(not pcall(amf3.apply_delta, {}, amf3.encode({s = {k1 = 1}}))) -- Invalid delta
+assert(not pcall(amf3.apply_delta, {k1 = 1}, amf3.encode({p = {__array = true, 'k1', {}}}))) -- Delta does not match value
+
 ----------------------
 -- Pack/unpack test --
 ----------------------
@@ -0,0 +1,215 @@
+#undef NDEBUG /* Checks must run in any build */
+#include <assert.h>
+#include <string.h>
+#include "libamf3.h"
+
+typedef struct {
+	char buf[1000];
+	size_t pos;
+	int calls;
+} Output;
+
+static int sink(void *ud, const char *data, size_t size) {
+	Output *out = ud;
+	if (out->pos + size > sizeof out->buf) return 1;
+	memcpy(out->buf + out->pos, data, size);
+	out->pos += size;
+	++out->calls;
+	return 0;
+}
+
+static void writeSample(amf3_Writer *w) {
+	static const char blob[300];
+	assert(!amf3_writeArray(w, 7));
+	assert(!amf3_writeInteger(w, -123));
+	assert(!amf3_writeInteger(w, 1 << 30)); /* Out of U29 range */
+	assert(!amf3_writeString(w, "abc", 3));
+	assert(!amf3_writeNull(w));
+	assert(!amf3_writeObject(w));
+	assert(!amf3_writeKey(w, "a", 1));
+	assert(!amf3_writeBoolean(w, 1));
+	assert(!amf3_writeObjectEnd(w));
+	assert(!amf3_writeObject(w)); /* Traits reference */
+	assert(!amf3_writeObjectEnd(w));
+	assert(!amf3_writeDictionary(w, 1));
+	assert(!amf3_writeRef(w, AMF3_OBJECT, 1));
+	assert(!amf3_writeByteArray(w, blob, sizeof blob));
+}
+
+static void next(amf3_Reader *r, amf3_Event *ev, int event, int type) {
+	assert(!amf3_next(r, ev));
+	assert(ev->event == event);
+	assert(ev->type == type);
+}
+
+static void readSample(const char *buf, size_t size) {
+	amf3_Reader r;
+	amf3_Event ev;
+	amf3_initReader(&r, buf, size, 0, 0);
+	next(&r, &ev, AMF3_EVENT_BEGIN, AMF3_ARRAY);
+	assert(ev.len == 7 && ev.parent == 0);
+	next(&r, &ev, AMF3_EVENT_VALUE, AMF3_INTEGER);
+	assert(ev.ival == -123 && ev.parent == AMF3_ARRAY && ev.index == 0);
+	next(&r, &ev, AMF3_EVENT_VALUE, AMF3_DOUBLE);
+	assert(ev.num == 1 << 30);
+	next(&r, &ev, AMF3_EVENT_VALUE, AMF3_STRING);
+	assert(ev.size == 3 && !memcmp(ev.data, "abc", 3));
+	next(&r, &ev, AMF3_EVENT_VALUE, AMF3_NULL);
+	next(&r, &ev, AMF3_EVENT_BEGIN, AMF3_OBJECT);
+	assert(ev.traits == AMF3_TRAITS_DYNAMIC && ev.size == 0 && ev.index == 4);
+	next(&r, &ev, AMF3_EVENT_VALUE, AMF3_TRUE);
+	assert(ev.ksize == 1 && *ev.key == 'a' && amf3_depth(&r) == 2);
+	next(&r, &ev, AMF3_EVENT_END, AMF3_OBJECT);
+	assert(ev.index == 4 && amf3_depth(&r) == 1);
+	next(&r, &ev, AMF3_EVENT_BEGIN, AMF3_OBJECT);
+	next(&r, &ev, AMF3_EVENT_END, AMF3_OBJECT);
+	next(&r, &ev, AMF3_EVENT_BEGIN, AMF3_DICTIONARY);
+	assert(ev.len == 1);
+	next(&r, &ev, AMF3_EVENT_VALUE, AMF3_OBJECT);
+	assert(ev.ref == 1 && ev.index == 0);
+	next(&r, &ev, AMF3_EVENT_VALUE, AMF3_BYTEARRAY);
+	assert(ev.ref == -1 && ev.size == 300 && ev.index == 1);
+	next(&r, &ev, AMF3_EVENT_END, AMF3_DICTIONARY);
+	next(&r, &ev, AMF3_EVENT_END, AMF3_ARRAY);
+	assert(ev.len == 7 && ev.parent == 0 && amf3_depth(&r) == 0);
+	assert(r.pos == size);
+	assert(amf3_next(&r, &ev) == AMF3_EDATA);
+	amf3_freeReader(&r);
+}
+
+static void testWriterReader(void) {
+	amf3_Arena arena;
+	amf3_Writer w;
+	amf3_initArena(&arena, 0, 0, 256);
+	amf3_initWriter(&w, amf3_arenaAlloc, &arena);
+	writeSample(&w);
+	readSample(w.buf, w.pos);
+	amf3_freeWriter(&w);
+	amf3_freeArena(&arena);
+}
+
+static void testSink(void) {
+	amf3_Writer w1, w2;
+	Output out = {{0}, 0, 0};
+	amf3_initWriter(&w1, 0, 0);
+	amf3_initWriter(&w2, 0, 0);
+	writeSample(&w1);
+	assert(!amf3_setSink(&w2, sink, &out, 16));
+	writeSample(&w2);
+	assert(!amf3_flush(&w2));
+	assert(w2.pos == 0 && w2.size == 16 && w2.total == w1.pos);
+	assert(out.pos == w1.pos && !memcmp(out.buf, w1.buf, w1.pos));
+	assert(out.calls > 1);
+	amf3_freeWriter(&w1);
+	amf3_freeWriter(&w2);
+}
+
+static void testStrings(void) {
+	static const char buf[] = {
+		0x09, 0x07, 0x01, /* Array (length 3) */
+			0x0a, 0x1b, 0x03, 0x43, 0x03, 0x41, /* Dynamic class C with static member A */
+				0x04, 0x01, /* A:1 */
+				0x02, 0x06, 0x00, /* A:'C' (dynamic member, key and value by reference) */
+				0x01, /* End of dynamic part */
+			0x0a, 0x01, /* Object (class reference 0) */
+				0x06, 0x02, /* A:'A' */
+				0x01, /* End of dynamic part */
+			0x06, 0x04 /* String (reference 2) */
+	};
+	amf3_Reader r;
+	amf3_Event ev;
+	amf3_initReader(&r, buf, sizeof buf, 0, 0);
+	next(&r, &ev, AMF3_EVENT_BEGIN, AMF3_ARRAY);
+	next(&r, &ev, AMF3_EVENT_BEGIN, AMF3_OBJECT);
+	assert(ev.len == 1 && ev.size == 1 && *ev.data == 'C');
+	next(&r, &ev, AMF3_EVENT_VALUE, AMF3_INTEGER);
+	assert(ev.ksize == 1 && *ev.key == 'A' && ev.ival == 1);
+	next(&r, &ev, AMF3_EVENT_VALUE, AMF3_STRING);
+	assert(ev.ksize == 1 && *ev.key == 'A' && ev.size == 1 && *ev.data == 'C');
+	next(&r, &ev, AMF3_EVENT_END, AMF3_OBJECT);
+	assert(ev.size == 1 && *ev.data == 'C');
+	next(&r, &ev, AMF3_EVENT_BEGIN, AMF3_OBJECT);
+	assert(ev.traits == AMF3_TRAITS_DYNAMIC && ev.index == 1);
+	next(&r, &ev, AMF3_EVENT_VALUE, AMF3_STRING);
+	assert(ev.ksize == 1 && *ev.key == 'A' && ev.size == 1 && *ev.data == 'A');
+	next(&r, &ev, AMF3_EVENT_END, AMF3_OBJECT);
+	assert(amf3_next(&r, &ev) == AMF3_EREF);
+	assert(!strcmp(r.msg, "invalid reference 2 at position 22"));
+	amf3_freeReader(&r);
+}
+
+static void testErrors(void) {
+	static const char buf[] = {0x0a, 0x00, 0x09, 0x03, 0x01, 0x12};
+	amf3_Reader r;
+	amf3_Event ev;
+	amf3_initReader(&r, buf, sizeof buf, 0, 0);
+	assert(amf3_next(&r, &ev) == AMF3_EREF);
+	assert(!strcmp(r.msg, "invalid reference 0 at position 2"));
+	r.pos = 2;
+	next(&r, &ev, AMF3_EVENT_BEGIN, AMF3_ARRAY);
+	assert(amf3_next(&r, &ev) == AMF3_ETYPE);
+	assert(!strcmp(r.msg, "invalid value type 18 at position 6"));
+	r.pos = 5;
+	assert(amf3_readDouble(&r, &ev.num) == AMF3_EDATA);
+	assert(!strcmp(r.msg, "insufficient IEEE-754 data at position 6"));
+	amf3_freeReader(&r);
+}
+
+static void testLimits(void) {
+	static const char buf[] = {
+		0x09, 0x05, 0x01, /* Array (length 2) */
+			0x06, 0x07, 0x61, 0x62, 0x63, /* String 'abc' */
+			0x09, 0x03, 0x01, /* Array (length 1) */
+				0x06, 0x00 /* String (reference 0) */
+	};
+	amf3_Reader r;
+	amf3_Event ev;
+	amf3_initReader(&r, buf, sizeof buf, 0, 0);
+	r.maxdepth = 1;
+	next(&r, &ev, AMF3_EVENT_BEGIN, AMF3_ARRAY);
+	next(&r, &ev, AMF3_EVENT_VALUE, AMF3_STRING);
+	assert(amf3_next(&r, &ev) == AMF3_ELIMIT);
+	assert(!strcmp(r.msg, "too many nested values at position 9"));
+	amf3_freeReader(&r);
+	amf3_initReader(&r, buf, sizeof buf, 0, 0);
+	r.maxlen = 1;
+	assert(amf3_next(&r, &ev) == AMF3_ELIMIT);
+	assert(!strcmp(r.msg, "too many items at position 1"));
+	amf3_freeReader(&r);
+	amf3_initReader(&r, buf, sizeof buf, 0, 0);
+	r.maxnodes = 3;
+	r.maxbytes = 5;
+	next(&r, &ev, AMF3_EVENT_BEGIN, AMF3_ARRAY);
+	next(&r, &ev, AMF3_EVENT_VALUE, AMF3_STRING);
+	next(&r, &ev, AMF3_EVENT_BEGIN, AMF3_ARRAY);
+	assert(amf3_next(&r, &ev) == AMF3_ELIMIT); /* Position includes empty associative part of the array */
+	assert(!strcmp(r.msg, "too many values at position 11"));
+	assert(r.bytes == 6);
+	amf3_freeReader(&r);
+}
+
+static void testArena(void) {
+	amf3_Arena arena;
+	char *p1, *p2, *p3;
+	amf3_initArena(&arena, 0, 0, 64);
+	p1 = amf3_arenaAlloc(&arena, 0, 0, 10);
+	p2 = amf3_arenaAlloc(&arena, p1, 10, 20); /* Most recent block grows in place */
+	assert(p1 == p2);
+	p3 = amf3_arenaAlloc(&arena, 0, 0, 1000); /* Dedicated chunk */
+	assert(p3 && amf3_arenaAlloc(&arena, 0, 0, 8) == p1 + 24);
+	memset(p3, 1, 1000);
+	assert(!amf3_arenaAlloc(&arena, p3, 1000, 0));
+	amf3_resetArena(&arena);
+	assert(amf3_arenaAlloc(&arena, 0, 0, 8) == p1);
+	amf3_freeArena(&arena);
+}
+
+int main(void) {
+	testWriterReader();
+	testSink();
+	testStrings();
+	testErrors();
+	testLimits();
+	testArena();
+	return 0;
+}